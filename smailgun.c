@@ -31,13 +31,37 @@
  * Simple tree structure. It is a btree but not a binary search tree.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <syslog.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <curl/curl.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define VERSION "0.1"
 
@@ -45,6 +69,14 @@
 #define CONFIGURATION_FILE "/etc/smailgun/smailgun.conf"
 #endif
 
+#ifndef ALIASES_FILE
+#define ALIASES_FILE "/etc/aliases"
+#endif
+
+#ifndef QUEUE_DIR
+#define QUEUE_DIR "/var/spool/smailgun"
+#endif
+
 #ifndef LOG_FILE
 #define LOG_FILE "/var/log/smailgun.log"
 #endif
@@ -57,30 +89,263 @@
 #define MAXARGS 1024
 #endif
 
+/* Initial slot count of the recipient set, must be a power of two */
+#ifndef RCPT_SET_SZ
+#define RCPT_SET_SZ 64
+#endif
+
+/* Maximum nesting of alias expansion */
+#ifndef ALIAS_DEPTH
+#define ALIAS_DEPTH 8
+#endif
+
+/* Entries in the username to uid cache */
+#ifndef UID_CACHE_SZ
+#define UID_CACHE_SZ 64
+#endif
+
+#define ALIAS_MAGIC "SMA1"
+#define ALIAS_HDR_SZ 16
+
+#define METRICS_MAGIC "SMSTAT1"
+
+/* Trace records buffered between the delivery path and the flusher */
+#ifndef TRACE_RING
+#define TRACE_RING 256
+#endif
+
+#define QID_SZ 20
+
+/* Index slots per journal segment, must be a power of two */
+#ifndef JOURNAL_SLOTS
+#define JOURNAL_SLOTS (1 << 18)
+#endif
+
+/* Rotate the journal once it grows past this many bytes */
+#ifndef JOURNAL_SIZE
+#define JOURNAL_SIZE (64 * 1024 * 1024)
+#endif
+
+/* Rotated journal segments to keep */
+#ifndef JOURNAL_KEEP
+#define JOURNAL_KEEP 90
+#endif
+
+#define ENDPOINT "https://api.mailgun.net/v3/%s/messages.mime"
+
+#define JOURNAL_MAGIC "SMJRNL1"
+#define QINDEX_MAGIC "SMQIDX2"
+#define HEALTH_MAGIC "SMHLTH1"
+#define BUDGET_MAGIC "SMBDGT1"
+
+/* Idle connections kept per route */
+#ifndef ROUTE_POOL
+#define ROUTE_POOL 4
+#endif
+
+/* API endpoints per route */
+#ifndef ROUTE_ENDPOINTS
+#define ROUTE_ENDPOINTS 4
+#endif
+
+/* Consecutive failures before an endpoint is taken out of rotation */
+#ifndef ENDPOINT_FAILS
+#define ENDPOINT_FAILS 3
+#endif
+
+/* How long an endpoint stays out of rotation, us */
+#ifndef ENDPOINT_BACKOFF
+#define ENDPOINT_BACKOFF 30000000
+#endif
+
+/* Weight of the newest sample in the latency and error averages */
+#ifndef ENDPOINT_ALPHA
+#define ENDPOINT_ALPHA 0.2
+#endif
+
+/* Health slots in the shared health file, must be a power of two */
+#ifndef HEALTH_SLOTS
+#define HEALTH_SLOTS 64
+#endif
+
+/* Connect timeout, ms, a dead region should fail over quickly */
+#ifndef CONNECT_TIMEOUT
+#define CONNECT_TIMEOUT 3000
+#endif
+
+/* Initial slot count of the queue index, must be a power of two */
+#ifndef QINDEX_SLOTS
+#define QINDEX_SLOTS 1024
+#endif
+
+/* Bytes a sender may send per deficit round robin turn in its lane */
+#ifndef DRR_QUANTUM
+#define DRR_QUANTUM (32 * 1024)
+#endif
+
+/* What a request costs on top of its bytes, in bytes */
+#ifndef DRR_MSG_COST
+#define DRR_MSG_COST (8 * 1024)
+#endif
+
+/* Microseconds the queue runner works from one scan before it rescans
+   for new mail in the faster lanes */
+#ifndef QUEUE_SLICE
+#define QUEUE_SLICE 2000000
+#endif
+
+/* Seconds between queue runs of the daemon */
+#ifndef QUEUE_INTERVAL
+#define QUEUE_INTERVAL 60
+#endif
+
+/* Seconds a deferred message is retried before it is given up */
+#ifndef QUEUE_LIFETIME
+#define QUEUE_LIFETIME (5 * 24 * 3600)
+#endif
+
+/* Longest wait between two attempts of a deferred message, seconds */
+#ifndef RETRY_MAX
+#define RETRY_MAX (4 * 3600)
+#endif
+
+/* Spooled messages from this size on are stored deflated, bytes */
+#ifndef SPOOL_COMPRESS
+#define SPOOL_COMPRESS (64 * 1024)
+#endif
+
+/* A deflated df file starts with this and the size of the message, a
+   plain one starts with a header field and never with a NUL */
+#define SPOOL_ZMAGIC "\0SMZ"
+#define SPOOL_ZHDR (4 + sizeof(uint64_t))
+
+/* Memory every smailgun process together may hold in messages, bytes,
+   and the messages in flight, see budget_take() */
+#ifndef BUDGET_BYTES
+#define BUDGET_BYTES (256 * 1024 * 1024)
+#endif
+
+#ifndef BUDGET_MSGS
+#define BUDGET_MSGS 1024
+#endif
+
+/* What a message costs on top of its bytes, handle and parse buffers */
+#ifndef BUDGET_MSG_COST
+#define BUDGET_MSG_COST (64 * 1024)
+#endif
+
+/* Processes sharing the budget file */
+#ifndef BUDGET_SLOTS
+#define BUDGET_SLOTS 256
+#endif
+
+/* Longest a submission waits for the budget before it reads its message, ms */
+#ifndef BUDGET_WAIT
+#define BUDGET_WAIT 2000
+#endif
+
+/* Initial slot count of the route table, must be a power of two */
+#ifndef ROUTE_TABLE_SZ
+#define ROUTE_TABLE_SZ 64
+#endif
+
+/* Longest line RFC 5322 allows, without the CRLF */
+#ifndef BODY_LINE_MAX
+#define BODY_LINE_MAX 998
+#endif
+
+/* Bytes the body is read in, canonicalized output may be twice as large */
+#ifndef CANON_CHUNK
+#define CANON_CHUNK (64 * 1024)
+#endif
+
+/* Vector kernels store a full vector past the last byte they keep */
+#define CANON_SLACK 32
+
+/* A line with a single "." ends the message */
+#define CANON_DOTEND 0x01
+
+/* Undo SMTP dot-stuffing as well, for input that came over SMTP */
+#define CANON_UNSTUFF 0x02
+
+enum canon_state {
+	CANON_BOL = 0,		/* At the start of a line */
+	CANON_TEXT,		/* Inside a line */
+	CANON_DOT,		/* Leading dot seen, not emitted yet */
+	CANON_DOTCR,		/* Leading dot and \r seen */
+	CANON_END		/* Lone dot line seen, the rest is ignored */
+};
+
+/*
+ * Body canonicalization state, carried from one chunk to the next
+ */
+struct canon {
+	int flags;
+	enum canon_state state;
+	int cr;			/* Last byte was \r */
+	size_t line;		/* Bytes in the current line so far */
+	int eightbit;		/* Saw a byte above 0x7f */
+	int longline;		/* Saw a line over BODY_LINE_MAX */
+};
+
+/* Uploads a --batch run keeps in flight */
+#ifndef BATCH_PARALLEL
+#define BATCH_PARALLEL 16
+#endif
+
+/* Latency histogram bucket bounds in microseconds, +Inf is implied */
+#define HIST_BUCKETS 13
+uint64_t hist_bound[(HIST_BUCKETS - 1)] = {
+	1000, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
 int have_from = 0;
 #ifdef HASTO_OPTION
 int have_to = 0;
 #endif
 int minus_t = 0;
 int minus_v = 0;
-int override_from = 0;
-int rewrite_domain = 0;
+int minus_bi = 0;
+int mailstats = 0;
+int slowest = 0;
+int minus_bd = 0;
+int minus_q = 0;
+int queue_only = 0;
+int minus_i = 0;
+int body_8bit = 0;
+int body_longline = 0;
+long canon_bench_mb = 0;
+long queue_interval = 0;
+volatile sig_atomic_t daemon_stop = 0;
+volatile sig_atomic_t daemon_reload = 0;
+int net_ready = 0;
+long since = 0;
+char *lookup = NULL;
+int minus_bp = 0;
+char *qfilter_sender = NULL;
+char *qfilter_rcpt = NULL;
+char *batch = NULL;
 
-char *api = NULL;
-char *domain = NULL;
 char *from = NULL;
-char *endpoint = "https://api.mailgun.net/v3/%s/messages";
 char *minus_f = NULL;
 char *minus_F = NULL;
 char *prog = NULL;
-char *root = NULL;
 char *uad = NULL;
 char *config_file = NULL;
+char *aliases_file = NULL;
+char *stats_file = NULL;
+char *trace_file = NULL;
+char *journal_file = NULL;
+char *health_file = NULL;
+char *queue_dir = NULL;
+char *message_id = NULL;
+char queue_id[QID_SZ];
 
 int log_level = 1;
 int have_to = 0;
 int have_date = 0;
-int minuserid = 0;
+int rcpt_count = 0;
 
 struct string_list {
 	char *string;
@@ -93,6 +358,483 @@ typedef struct string_list rcpt_t;
 headers_t headers, *ht;
 rcpt_t rcpt_list, *rt;
 
+struct rcpt_set {
+	unsigned long size;
+	unsigned long count;
+	char **slot;
+} rcpt_set;
+
+/*
+ * Compiled alias map, see alias_build() for the layout. The file is mapped
+ * once and queried in place, nothing is parsed at send time.
+ */
+struct alias_db {
+	int tried;
+	unsigned char *map;
+	size_t size;
+	uint32_t slots;
+} alias_db;
+
+struct uid_cache {
+	char *name;
+	long uid;
+} uid_cache[UID_CACHE_SZ];
+
+enum msg_state {
+	MSG_ACCEPTED,
+	MSG_PARSED,
+	MSG_SPOOLED,
+	MSG_SENT,
+	MSG_DEFERRED,
+	MSG_FAILED,
+	MSG_MAX
+};
+
+char *msg_state_name[MSG_MAX] = {
+	"accepted", "parsed", "spooled", "sent", "deferred", "failed"
+};
+
+enum stage {
+	STAGE_PARSE,
+	STAGE_QUEUE,
+	STAGE_DNS,
+	STAGE_CONNECT,
+	STAGE_TLS,
+	STAGE_FIRST_BYTE,
+	STAGE_TOTAL,
+	STAGE_MAX
+};
+
+char *stage_name[STAGE_MAX] = {
+	"parse", "queue", "dns", "connect", "tls", "first_byte", "total"
+};
+
+/*
+ * Delivery counters. Either process local or mapped from the -oS stats
+ * file and shared by every smailgun process, all updates are relaxed
+ * atomic adds so the hot path never takes a lock.
+ */
+struct metrics {
+	char magic[8];
+	_Atomic uint64_t msg[MSG_MAX];
+	_Atomic uint64_t bytes_in;
+	_Atomic uint64_t bytes_out;
+	_Atomic uint64_t http[6];	/* No response, 1xx .. 5xx */
+	_Atomic int64_t queue_depth;
+	struct {
+		_Atomic uint64_t bucket[HIST_BUCKETS];
+		_Atomic uint64_t count;
+		_Atomic uint64_t sum_us;
+	} stage[STAGE_MAX];
+} metrics_local, *metrics = &metrics_local;
+
+#define METRIC_ADD(field, n) \
+	atomic_fetch_add_explicit(&metrics->field, (n), memory_order_relaxed)
+
+/*
+ * One record per delivery attempt, written as a JSON line to the trace file
+ */
+struct trace {
+	uint64_t ts;			/* Wall clock at completion, us */
+	char qid[QID_SZ];
+	char msgid[128];		/* Message-Id assigned by Mailgun */
+	uint64_t size;
+	uint64_t bytes_out;
+	int rcpts;
+	int retries;
+	long code;
+	int status;
+	uint64_t t[STAGE_MAX];
+	char error[128];		/* Reason of the last failure, for the spool */
+};
+
+/*
+ * Single producer, single consumer ring. The delivery path only bumps head,
+ * the flusher thread only bumps tail, a full ring drops the record rather
+ * than stall a delivery.
+ */
+struct trace_ring {
+	struct trace rec[TRACE_RING];
+	_Atomic unsigned long head;
+	_Atomic unsigned long tail;
+	_Atomic unsigned long dropped;
+	int fd;
+	int stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} trace_ring = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * The counters of the daemon on a unix socket in the queue directory,
+ * answered by a thread of their own so a long queue run does not hold
+ * up a scrape.
+ */
+struct stats_server {
+	int fd;
+	pthread_t thread;
+	struct sockaddr_un addr;
+} stats_server = {
+	.fd = -1
+};
+
+/*
+ * Journal segment index, a fixed size open-addressing table mapped from
+ * <segment>.idx. A slot holds the hash of a key (queue ID, Message-ID or
+ * recipient) and the offset + 1 of its journal line, 0 marks a free slot.
+ * The offset is stored last so a reader never follows a half written slot.
+ */
+struct journal_hdr {
+	char magic[8];
+	uint64_t slots;
+	_Atomic uint64_t count;
+	uint64_t reserved;
+};
+
+struct journal_slot {
+	uint64_t hash;
+	_Atomic uint64_t off;
+};
+
+/*
+ * Queue index, <queue>/index. An open-addressing table keyed by queue ID
+ * with what mailq shows of each queued message, so listing the queue never
+ * opens the spool files. Writers hold an exclusive flock and double the
+ * table when it is three quarters used, mailq holds a shared one.
+ */
+struct qindex_hdr {
+	char magic[8];
+	uint64_t slots;
+	uint64_t used;		/* Live and deleted slots */
+	uint64_t live;
+	uint64_t complete;	/* Every spooled message is in, see qindex_rebuild() */
+	uint64_t generation;	/* Counts messages added, see queue_run() */
+};
+
+struct qindex_slot {
+	uint64_t hash;		/* Of the queue ID, 0 for free and 1 for deleted */
+	char qid[QID_SZ];
+	uint32_t rcpts;
+	uint32_t retries;
+	uint32_t uid;
+	uint32_t lane;
+	uint64_t size;
+	int64_t created;
+	int64_t next;
+	uint64_t bloom;		/* Two bits per recipient and per recipient domain */
+	char sender[80];
+	char error[72];
+};
+
+/*
+ * Priority lanes of the queue runner. Every round it takes up to
+ * lane_weight messages from each lane, so bulk mail is slowed down while
+ * other mail waits, never stopped.
+ */
+enum lane {
+	LANE_NORMAL = 0,
+	LANE_HIGH,
+	LANE_BULK,
+	LANE_MAX
+};
+
+char *lane_name[LANE_MAX] = { "normal", "high", "bulk" };
+int lane_weight[LANE_MAX] = { 4, 8, 1 };
+int lane_order[LANE_MAX] = { LANE_HIGH, LANE_NORMAL, LANE_BULK };
+
+/*
+ * A due message as the queue runner schedules it
+ */
+struct qentry {
+	char qid[QID_SZ];
+	int lane;
+	uint64_t owner;		/* Submitting uid, or hash of the sender */
+	uint64_t size;
+	int64_t created;
+};
+
+/*
+ * Deficit round robin state of the messages of one owner in a lane,
+ * list[start..end) in the sorted due list
+ */
+struct drr_flow {
+	size_t start;
+	size_t end;
+	uint64_t deficit;
+};
+
+struct drr_lane {
+	struct drr_flow *flow;
+	int nflow;
+	int active;		/* Flows with messages left */
+	int cur;
+};
+
+/*
+ * Sender rule of priority=, matched as an exact address or @domain
+ */
+struct lane_rule {
+	char *match;
+	int lane;
+	struct lane_rule *next;
+};
+
+enum route_kind {
+	ROUTE_DEFAULT,
+	ROUTE_ENVELOPE,		/* Exact sender address */
+	ROUTE_SENDER_DOMAIN,	/* @domain of the sender */
+	ROUTE_HEADER		/* Header:substring */
+};
+
+/*
+ * Latency and error averages of an API endpoint. Lives in the shared
+ * health file when one is configured, so short lived processes learn from
+ * each other, otherwise in process memory. Updates are racy on purpose,
+ * losing a sample now and then does not matter for an average.
+ */
+struct health {
+	uint64_t hash;			/* Of the endpoint URL */
+	_Atomic int64_t ewma_us;	/* 0 until the first sample */
+	_Atomic int64_t err_ppm;	/* Error rate in parts per million */
+	_Atomic int64_t fails;		/* Consecutive failures */
+	_Atomic int64_t down_until;	/* Wall clock, us */
+};
+
+struct health_file {
+	char magic[8];
+	struct health slot[HEALTH_SLOTS];
+} health_local, *health_map = &health_local;
+
+/*
+ * Share of the memory budget held by one process. The table lives in the
+ * budget file of the queue directory, a slot of a process that is gone is
+ * taken over by the next one that needs a slot.
+ */
+struct budget {
+	_Atomic int64_t pid;
+	_Atomic int64_t bytes;
+	_Atomic int64_t msgs;
+};
+
+struct budget_file {
+	char magic[8];
+	struct budget slot[BUDGET_SLOTS];
+} budget_local, *budget_map = &budget_local;
+
+struct budget *budget_self = NULL;
+int budget_ready = 0;
+
+/*
+ * An idle connection. The handle keeps the socket alive between requests,
+ * used tells the daemon when it has to be refreshed.
+ */
+struct conn {
+	CURL *curl;
+	uint64_t used;
+};
+
+struct endpoint {
+	char *url;
+	struct health *health;
+	int idle;
+	struct conn pool[ROUTE_POOL];
+};
+
+/*
+ * A Mailgun account to deliver through. Each route keeps its own idle
+ * connections and its own token bucket, one tenant cannot use up the
+ * connections or the send rate of another.
+ */
+struct route {
+	int kind;
+	char *match;
+	char *domain;
+	char *api;
+	char *endpoint;		/* Comma separated URL formats */
+	char *userpwd;
+	double rate;		/* Messages per second, 0 is unlimited */
+	double tokens;
+	uint64_t last;
+	int nep;
+	struct endpoint ep[ROUTE_ENDPOINTS];
+	char *line;		/* Config line the strings above point into */
+	struct route *next;
+};
+
+
+/*
+ * A spooled message. The qf<qid> control file holds these fields and the
+ * recipients, df<qid> holds the assembled MIME message.
+ */
+struct qmsg {
+	char qid[QID_SZ];
+	int route_kind;
+	char *route;		/* Match of the route, NULL for the default */
+	char *msgid;		/* Message-ID header */
+	char error[128];
+	long created;
+	long next;
+	int retries;
+	int lane;
+	int uid;		/* Of the submitting user */
+	size_t size;		/* Of a message spooled while read, see spool_stream() */
+};
+
+/*
+ * A df file written while the message streams in, plain or deflated
+ */
+struct spool_sink {
+	int fd;
+	int zip;
+	uint64_t len;		/* Bytes of the message put so far */
+	uint64_t out;		/* Bytes written to the file */
+	z_stream z;
+	unsigned char buf[CANON_CHUNK];
+};
+
+/*
+ * The message an upload reads, from memory or from a plain or deflated
+ * df file, see body_read()
+ */
+struct body {
+	char *msg;		/* In memory, NULL when read from the spool */
+	size_t len;		/* Size of the message */
+	size_t pos;		/* Bytes handed to the upload so far */
+	int fd;
+	off_t start;		/* Of the message data in the df file */
+	int deflated;
+	z_stream z;
+	unsigned char *in;	/* Deflated data read from the df file */
+};
+
+/*
+ * The multipart form of a message, encoded once and shared read only by
+ * every request for it: the recipient fields and the header of the
+ * message part, the message itself read through its body, and the
+ * closing boundary. See form_new().
+ */
+struct form {
+	_Atomic long refs;
+	char *head;
+	size_t head_len;
+	struct body *body;
+	char tail[64];
+	size_t tail_len;
+	curl_off_t size;		/* Of the whole form */
+	struct curl_slist *headers;	/* Content-Type with the boundary */
+};
+
+/*
+ * One upload of a message to one endpoint, in flight or just finished
+ */
+struct request {
+	struct route *route;
+	struct endpoint *ep;
+	CURL *curl;
+	struct form *form;
+	curl_off_t pos;		/* Bytes of the form handed to curl */
+	char response[(BUF_SZ + 1)];
+};
+
+/*
+ * Recipients of a message, taken out of the globals while it waits
+ */
+struct rcpt_state {
+	rcpt_t list;
+	struct rcpt_set set;
+	int count;
+};
+
+/*
+ * A message of a --batch run, parsed and waiting for its upload
+ */
+struct batch_msg {
+	int n;			/* Position in the input, from 1 */
+	char source[(BUF_SZ + 1)];
+	char *msg;
+	size_t len;
+	struct body body;
+	char *msgid;		/* Message-ID header */
+	struct route *route;
+	struct rcpt_state rcpts;
+	struct qmsg q;
+	struct trace tr;
+	struct request rq;
+	struct form *form;
+	int tried;		/* Bitmask of the endpoints tried */
+	int64_t cost;		/* Reserved with budget_take() */
+	struct batch_msg *next;	/* Waiting for a token of its route */
+};
+
+/* What became of a message of a --batch run */
+enum batch_result {
+	BATCH_SENT = 0,
+	BATCH_QUEUED,
+	BATCH_FAILED
+};
+
+/*
+ * Where a --batch run reads messages from: an mbox stream or a Maildir
+ */
+struct batch_src {
+	FILE *mbox;
+	char *line;		/* Line buffer of the mbox reader */
+	size_t cap;
+	char *maildir;
+	DIR *dir;
+	int sub;		/* 0 for new/, 1 for cur/ */
+	int n;
+};
+
+/*
+ * Envelope and sender domain routes compiled into one open-addressing
+ * table keyed by the lowercased address or domain. Header routes are
+ * few and stay in the list.
+ */
+struct route_table {
+	unsigned long size;
+	unsigned long count;
+	struct route **slot;
+};
+
+/*
+ * Everything read from smailgun.conf that may change on SIGHUP. A config
+ * is never modified once published; a reload builds a new one and swaps
+ * the pointer. Deliveries pin the config they started with through the
+ * reference count, the last release frees it. File locations (queue,
+ * journal, trace, stats, health) are process settings fixed at startup.
+ */
+struct config {
+	_Atomic long refs;
+	char *api;
+	char *domain;
+	char *rewrite;
+	char *endpoint;
+	char *root;
+	int minuserid;
+	int override_from;
+	int rewrite_domain;
+	long timeout;
+	int prewarm;
+	long keepalive;
+	long compress;		/* Deflate spooled messages from this size on */
+	long budget_bytes;	/* 0 is no limit */
+	long budget_msgs;
+	int fair_sender;	/* Share the queue per sender, not per uid */
+	struct lane_rule *lanes;
+	struct route default_route;
+	struct route *routes;
+	struct route_table route_table;
+};
+
+/* The published config, and the one pinned by the current delivery */
+_Atomic(struct config *) config_live = NULL;
+struct config *cfg = NULL;
+
 /*
  * strndup() - Duplicate a string.
  */
@@ -113,6 +855,8 @@ char *_basename(char *str) {
 	p = strrchr(str, '/');
 	if (!p) {
 		p = str;
+	} else {
+		p++;
 	}
 
 	return strdup(p);
@@ -159,51 +903,184 @@ void die(char *format, ...) {
 }
 
 /*
- *strip_pre_ws() -- Return pointer to first non-whitespace character
+ * now_us() -- Monotonic clock in microseconds
  */
-char *strip_pre_ws(char *str) {
-	char *p;
+uint64_t now_us() {
+	struct timespec ts;
 
-	p = str;
-	while (*p && isspace(*p))
-		p++;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	return p;
+	return (((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
 }
 
 /*
- * strip_post_ws() -- Return pointer to last non-whitespace character
+ * metrics_open() -- Map the shared stats file, fall back to local counters
  */
-char *strip_post_ws(char *str) {
-	char *p;
+void metrics_open(char *file) {
+	struct metrics *m;
+	struct stat st;
+	int fd;
 
-	p = (str + strlen(str));
-	while (isspace(*--p)) {
-		*p = '\0';
+	if ((fd = open(file, O_RDWR | O_CREAT, 0644)) < 0) {
+		log_event(LOG_ERR, "cannot open stats file %s", file);
+		return;
 	}
 
-	return p;
+	if (fstat(fd, &st) < 0
+		|| (st.st_size < (off_t)sizeof(struct metrics)
+			&& ftruncate(fd, sizeof(struct metrics)) < 0)) {
+		log_event(LOG_ERR, "cannot size stats file %s", file);
+		close(fd);
+		return;
+	}
+
+	m = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		log_event(LOG_ERR, "cannot map stats file %s", file);
+		return;
+	}
+
+	/* A fresh file is all zeroes, claim it */
+	if (m->magic[0] == '\0') {
+		memcpy(m->magic, METRICS_MAGIC, sizeof(m->magic));
+	}
+
+	if (memcmp(m->magic, METRICS_MAGIC, sizeof(m->magic)) != 0) {
+		log_event(LOG_ERR, "stats file %s has unknown format", file);
+		munmap(m, sizeof(struct metrics));
+		return;
+	}
+
+	metrics = m;
 }
 
 /*
- * addr_parse() -- Parse <user@domain.com> from full email address
+ * metrics_observe() -- Record a stage latency in its histogram
  */
-char *addr_parse(char *str) {
-	char *p, *q;
+void metrics_observe(int stage, uint64_t us) {
+	int i;
 
-#if 0
-	fprintf(stdout, "*** addr_parse(): str = [%s]\n", str);
-#endif
+	for (i = 0; i < (HIST_BUCKETS - 1) && us > hist_bound[i]; i++);
 
-	/* Simple case with email address enclosed in <> */
-	if((p = strdup(str)) == (char *)NULL) {
-		die("addr_parse(): strdup()");
-	}
+	METRIC_ADD(stage[stage].bucket[i], 1);
+	METRIC_ADD(stage[stage].count, 1);
+	METRIC_ADD(stage[stage].sum_us, us);
+}
 
-	if((q = strchr(p, '<'))) {
-		q++;
+/*
+ * metrics_write() -- Render counters in the Prometheus text format
+ */
+void metrics_write(FILE *fp) {
+	uint64_t cum;
+	int i, j;
 
-		if((p = strchr(q, '>'))) {
+#define LOAD(v) atomic_load_explicit(&(v), memory_order_relaxed)
+
+	fprintf(fp, "# TYPE smailgun_messages_total counter\n");
+	for (i = 0; i < MSG_MAX; i++) {
+		fprintf(fp, "smailgun_messages_total{state=\"%s\"} %lu\n",
+			msg_state_name[i], (unsigned long)LOAD(metrics->msg[i]));
+	}
+
+	fprintf(fp, "# TYPE smailgun_bytes_total counter\n");
+	fprintf(fp, "smailgun_bytes_total{direction=\"in\"} %lu\n",
+		(unsigned long)LOAD(metrics->bytes_in));
+	fprintf(fp, "smailgun_bytes_total{direction=\"out\"} %lu\n",
+		(unsigned long)LOAD(metrics->bytes_out));
+
+	fprintf(fp, "# TYPE smailgun_http_responses_total counter\n");
+	for (i = 0; i < 6; i++) {
+		if (i == 0) {
+			fprintf(fp, "smailgun_http_responses_total{class=\"none\"} %lu\n",
+				(unsigned long)LOAD(metrics->http[i]));
+		} else {
+			fprintf(fp, "smailgun_http_responses_total{class=\"%dxx\"} %lu\n",
+				i, (unsigned long)LOAD(metrics->http[i]));
+		}
+	}
+
+	fprintf(fp, "# TYPE smailgun_queue_depth gauge\n");
+	fprintf(fp, "smailgun_queue_depth %ld\n", (long)LOAD(metrics->queue_depth));
+
+	fprintf(fp, "# TYPE smailgun_stage_seconds histogram\n");
+	for (i = 0; i < STAGE_MAX; i++) {
+		for (cum = 0, j = 0; j < HIST_BUCKETS; j++) {
+			cum += LOAD(metrics->stage[i].bucket[j]);
+			if (j < (HIST_BUCKETS - 1)) {
+				fprintf(fp, "smailgun_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n",
+					stage_name[i], (hist_bound[j] / 1e6), (unsigned long)cum);
+			} else {
+				fprintf(fp, "smailgun_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n",
+					stage_name[i], (unsigned long)cum);
+			}
+		}
+		fprintf(fp, "smailgun_stage_seconds_sum{stage=\"%s\"} %g\n",
+			stage_name[i], (LOAD(metrics->stage[i].sum_us) / 1e6));
+		fprintf(fp, "smailgun_stage_seconds_count{stage=\"%s\"} %lu\n",
+			stage_name[i], (unsigned long)LOAD(metrics->stage[i].count));
+	}
+
+#undef LOAD
+}
+
+/* pae() - Write error message and exit */
+void pae(char *format, ...) {
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+
+	exit(0);
+}
+
+/*
+ *strip_pre_ws() -- Return pointer to first non-whitespace character
+ */
+char *strip_pre_ws(char *str) {
+	char *p;
+
+	p = str;
+	while (*p && isspace(*p))
+		p++;
+
+	return p;
+}
+
+/*
+ * strip_post_ws() -- Return pointer to last non-whitespace character
+ */
+char *strip_post_ws(char *str) {
+	char *p;
+
+	p = (str + strlen(str));
+	while (isspace(*--p)) {
+		*p = '\0';
+	}
+
+	return p;
+}
+
+/*
+ * addr_parse() -- Parse <user@domain.com> from full email address
+ */
+char *addr_parse(char *str) {
+	char *p, *q;
+
+#if 0
+	fprintf(stdout, "*** addr_parse(): str = [%s]\n", str);
+#endif
+
+	/* Simple case with email address enclosed in <> */
+	if((p = strdup(str)) == (char *)NULL) {
+		die("addr_parse(): strdup()");
+	}
+
+	if((q = strchr(p, '<'))) {
+		q++;
+
+		if((p = strchr(q, '>'))) {
 			*p = '\0';
 		}
 
@@ -264,180 +1141,673 @@ char *from_strip(char *str) {
 }
 
 /*
- * rcpt_save() -- Store entry into RCPT list
+ * rcpt_normalize() -- Canonical form of an address for delivery and dedup
+ *	Strips (comments) and surrounding whitespace, lowercases the domain.
+ *	The local part is left alone, it may be case sensitive.
  */
-void rcpt_save(char *str) {
-	char *p;
-
-#if 1
-	/* Horrible botch for group stuff */
-	p = str;
-	while(*p)
-		p++;
+char *rcpt_normalize(char *str) {
+	int in_quotes = 0, depth = 0;
+	char *p, *q, *at = (char *)NULL;
 
-	if(*--p == ';') {
-		return;
+	if ((p = malloc(strlen(str) + 1)) == (char *)NULL) {
+		die("rcpt_normalize() -- malloc() failed");
 	}
-#endif
 
-#if 1
-	fprintf(stdout, "*** rcpt_save(): str = [%s]\n", str);
-#endif
+	q = p;
+	for (str = strip_pre_ws(str); *str; str++) {
+		if (*str == '"' && depth == 0) {
+			in_quotes = !in_quotes;
+		} else if (!in_quotes && *str == '(') {
+			depth++;
+			continue;
+		} else if (!in_quotes && *str == ')' && depth > 0) {
+			depth--;
+			continue;
+		}
 
-	/* Ignore missing usernames */
-	if (*str == '\0') {
-		return;
+		if (depth > 0) {
+			continue;
+		}
+
+		if (!in_quotes && *str == '@') {
+			at = q;
+		}
+		*q++ = *str;
 	}
+	*q = '\0';
 
-	if ((rt->string = strdup(str)) == (char *)NULL) {
-		die("rcpt_save() -- strdup() failed");
+	if (q != p) {
+		strip_post_ws(p);
 	}
 
-	rt->next = (rcpt_t *)malloc(sizeof(rcpt_t));
-	if (rt->next == (rcpt_t *)NULL) {
-		die("rcpt_save() -- malloc() failed");
+	if (at) {
+		while (*++at) {
+			*at = tolower((unsigned char)*at);
+		}
 	}
-	rt = rt->next;
 
-	rt->next = (rcpt_t *)NULL;
+	return p;
 }
 
 /*
- * rcpt_parse() -- Break To|Cc|Bcc into individual addresses
+ * rcpt_hash() -- FNV-1a hash of a normalized address
  */
-void rcpt_parse(char *str) {
-	int in_quotes = 0, got_addr = 0;
-	char *p, *q, *r;
-
-#if 1
-	fprintf(stdout, "*** rcpt_parse(): str = [%s]\n", str);
-#endif
+unsigned long rcpt_hash(const char *str) {
+	unsigned long h = 14695981039346656037UL;
 
-	if ((p = strdup(str)) == (char *)NULL) {
-		die("rcpt_parse(): strdup() failed");
+	while (*str) {
+		h ^= (unsigned char)*str++;
+		h *= 1099511628211UL;
 	}
-	q = p;
 
-	/* Replace <CR>, <LF> and <TAB> */
-	while (*q) {
-		switch (*q) {
-			case '\t':
-			case '\n':
-			case '\r':
-					*q = ' ';
-		}
-		q++;
-	}
-	q = p;
+	return h;
+}
 
-#if 1
-	fprintf(stdout, "*** rcpt_parse(): q = [%s]\n", q);
-#endif
+/*
+ * rcpt_seen() -- Insert into the recipient set, return 1 if already present
+ *	Open addressing with linear probing, the table is doubled at 3/4 load
+ *	so that a probe sequence stays short even for large distribution lists.
+ */
+int rcpt_seen(char *str) {
+	unsigned long i, mask;
 
-	r = q;
-	while (*q) {
-		if (*q == '"') {
-			in_quotes = (in_quotes ? 0 : 1);
-		}
+	if (rcpt_set.count * 4 >= rcpt_set.size * 3) {
+		struct rcpt_set old = rcpt_set;
 
-		/* End of string? */
-		if (*(q + 1) == '\0') {
-			got_addr = 1;
+		rcpt_set.size = (old.size ? (old.size * 2) : RCPT_SET_SZ);
+		rcpt_set.count = 0;
+		rcpt_set.slot = (char **)calloc(rcpt_set.size, sizeof(char *));
+		if (rcpt_set.slot == (char **)NULL) {
+			die("rcpt_seen() -- calloc() failed");
 		}
 
-		/* End of address? */
-		if ((*q == ',') && (in_quotes == 0)) {
-			got_addr = 1;
-
-			*q = '\0';
+		for (i = 0; i < old.size; i++) {
+			if (old.slot[i]) {
+				rcpt_seen(old.slot[i]);
+			}
 		}
+		free(old.slot);
+	}
 
-		if (got_addr) {
-			while (*r && isspace(*r))
-				r++;
-
-			rcpt_save(addr_parse(r));
-			r = (q + 1);
-#if 1
-			fprintf(stdout, "*** rcpt_parse(): r = [%s]\n", r);
-#endif
-			got_addr = 0;
+	mask = (rcpt_set.size - 1);
+	for (i = (rcpt_hash(str) & mask); rcpt_set.slot[i]; i = ((i + 1) & mask)) {
+		if (strcmp(rcpt_set.slot[i], str) == 0) {
+			return 1;
 		}
-		q++;
 	}
-	free(p);
+	rcpt_set.slot[i] = str;
+	rcpt_set.count++;
+
+	return 0;
 }
 
 /*
- * header_save() -- Store entry into header list
+ * alias_db_file() -- Name of the compiled alias map for an aliases file
  */
-void header_save(char *str) {
+char *alias_db_file(char *file) {
 	char *p;
 
-#if 0
-	fprintf(stdout, "header_save(): str = [%s]\n", str);
-#endif
+	if ((p = malloc(strlen(file) + 4)) == (char *)NULL) {
+		die("alias_db_file() -- malloc() failed");
+	}
+	sprintf(p, "%s.db", file);
 
-	if ((p = strdup(str)) == (char *)NULL) {
-		die("header_save() -- strdup() failed");
+	return p;
+}
+
+/*
+ * alias_build() -- Compile an aliases file into a mmap'able hash file
+ *	Layout: magic, slot count and entry count (16 bytes), then a power of
+ *	two table of { hash, offset } pairs, then the records. A record is the
+ *	key followed by each normalized target, all NUL terminated, and closed
+ *	by an empty string. An offset of 0 marks a free slot.
+ */
+int alias_build(char *file) {
+	char buf[(BUF_SZ + 1)], *line = NULL, *rec = NULL, *db, *tmp, *p, *q;
+	size_t line_len = 0, rec_len = 0, rec_size = 0, len;
+	uint32_t *table, slots = 16, count = 0, i, h, mask, off;
+	uint32_t *entry = NULL;
+	FILE *fp;
+	int c, fd;
+
+	if ((fp = fopen(file, "r")) == (FILE *)NULL) {
+		die("cannot open %s", file);
 	}
-	ht->string = p;
 
-	if (strncasecmp(ht->string, "From:", 5) == 0) {
-		/* Hack check for NULL From: line */
-		if (*(p + 6) == '\0') {
-			return;
+	/* Gather logical lines, joining continuations that start with white space */
+	for (;;) {
+		int eof = (fgets(buf, sizeof(buf), fp) == (char *)NULL);
+
+		if (!eof && (p = strchr(buf, '#'))) {
+			*p = '\0';
 		}
 
-		if (override_from == 1) {
-			from = from_strip(ht->string);
+		if (!eof && line_len && (buf[0] == ' ' || buf[0] == '\t')) {
+			len = strlen(buf);
+			if ((line = realloc(line, line_len + len + 1)) == (char *)NULL) {
+				die("alias_build() -- realloc() failed");
+			}
+			memcpy(line + line_len, buf, len + 1);
+			line_len += len;
+			continue;
 		}
-		have_from = 1;
-	} else if(strncasecmp(ht->string, "To:" ,3) == 0) {
-		have_to = 1;
-	} else if(strncasecmp(ht->string, "Date:", 5) == 0) {
-		have_date = 1;
+
+		if (line_len && (p = strchr(line, ':'))) {
+			int in_quotes = 0;
+
+			*p++ = '\0';
+			q = strip_pre_ws(line);
+			if (*q) {
+				strip_post_ws(q);
+			}
+			for (char *k = q; *k; k++) {
+				*k = tolower((unsigned char)*k);
+			}
+
+			/* Room for the key, every target and the terminator */
+			len = strlen(q) + strlen(p) + 3;
+			if (rec_len + len >= rec_size) {
+				rec_size = (rec_len + len) * 2;
+				if ((rec = realloc(rec, rec_size)) == (char *)NULL) {
+					die("alias_build() -- realloc() failed");
+				}
+			}
+			if ((count % 64) == 0) {
+				entry = realloc(entry, (count + 64) * sizeof(uint32_t));
+				if (entry == (uint32_t *)NULL) {
+					die("alias_build() -- realloc() failed");
+				}
+			}
+			entry[count++] = rec_len;
+			strcpy(rec + rec_len, q);
+			rec_len += strlen(q) + 1;
+
+			/* Split targets on commas outside of quotes */
+			for (q = p; ; p++) {
+				if (*p == '"') {
+					in_quotes = !in_quotes;
+				}
+				if (*p && (*p != ',' || in_quotes)) {
+					continue;
+				}
+
+				c = *p;
+				*p = '\0';
+				q = strip_pre_ws(q);
+				if (*q == '|' || *q == '/' || strncmp(q, ":include:", 9) == 0) {
+					log_event(LOG_INFO, "alias target \"%s\" not supported", q);
+				} else if (*q) {
+					char *t = rcpt_normalize(addr_parse(q));
+
+					if (*t) {
+						strcpy(rec + rec_len, t);
+						rec_len += strlen(t) + 1;
+					}
+					free(t);
+				}
+
+				if (!c) {
+					break;
+				}
+				q = (p + 1);
+			}
+			rec[rec_len++] = '\0';
+		}
+
+		if (eof) {
+			break;
+		}
+
+		free(line);
+		if ((line = strdup(buf)) == (char *)NULL) {
+			die("alias_build() -- strdup() failed");
+		}
+		line_len = strlen(line);
 	}
+	fclose(fp);
+	free(line);
 
-	if (minus_t) {
-		/* Need to figure out recipients from the e-mail */
-		if(strncasecmp(ht->string, "To:", 3) == 0) {
-			p = (ht->string + 3);
-			rcpt_parse(p);
-		} else if(strncasecmp(ht->string, "Bcc:", 4) == 0) {
-			p = (ht->string + 4);
-			rcpt_parse(p);
-           /* Undo adding the header to the list: */
-           free(ht->string);
-           ht->string = NULL;
-           return;
-		} else if(strncasecmp(ht->string, "CC:", 3) == 0) {
-			p = (ht->string + 3);
-			rcpt_parse(p);
+	while (slots < (count * 2)) {
+		slots *= 2;
+	}
+	mask = (slots - 1);
+
+	table = (uint32_t *)calloc(slots, (2 * sizeof(uint32_t)));
+	if (table == (uint32_t *)NULL) {
+		die("alias_build() -- calloc() failed");
+	}
+
+	off = (ALIAS_HDR_SZ + (slots * 2 * sizeof(uint32_t)));
+	for (i = 0; i < count; i++) {
+		char *key = (rec + entry[i]);
+
+		h = (uint32_t)rcpt_hash(key);
+		for (c = (h & mask); table[(2 * c) + 1]; c = ((c + 1) & mask)) {
+			if (table[2 * c] == h && strcmp(rec + table[(2 * c) + 1] - off, key) == 0) {
+				log_event(LOG_INFO, "duplicate alias \"%s\" ignored", key);
+				break;
+			}
+		}
+		if (!table[(2 * c) + 1]) {
+			table[2 * c] = h;
+			table[(2 * c) + 1] = (off + entry[i]);
 		}
 	}
 
-#if 0
-	fprintf(stdout, "header_save(): ht->string = [%s]\n", ht->string);
-#endif
+	/* Write next to the target and rename, readers never see a partial map */
+	db = alias_db_file(file);
+	if ((tmp = malloc(strlen(db) + 5)) == (char *)NULL) {
+		die("alias_build() -- malloc() failed");
+	}
+	sprintf(tmp, "%s.tmp", db);
 
-	ht->next = (headers_t *)malloc(sizeof(headers_t));
-	if (ht->next == (headers_t *)NULL) {
-		die("header_save() -- malloc() failed");
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		die("cannot create %s", tmp);
 	}
-	ht = ht->next;
 
-	ht->next = (headers_t *)NULL;
+	memcpy(buf, ALIAS_MAGIC, 4);
+	memcpy(buf + 4, &slots, sizeof(uint32_t));
+	memcpy(buf + 8, &count, sizeof(uint32_t));
+	memset(buf + 12, 0, 4);
+
+	if (write(fd, buf, ALIAS_HDR_SZ) != ALIAS_HDR_SZ
+		|| write(fd, table, (slots * 2 * sizeof(uint32_t))) != (ssize_t)(slots * 2 * sizeof(uint32_t))
+		|| write(fd, rec, rec_len) != (ssize_t)rec_len
+		|| fsync(fd) < 0) {
+		die("alias_build() -- write() failed");
+	}
+	close(fd);
+
+	if (rename(tmp, db) < 0) {
+		die("alias_build() -- rename() failed");
+	}
+
+	free(tmp);
+	free(db);
+	free(table);
+	free(entry);
+	free(rec);
+
+	return count;
 }
 
 /*
- * header_parse() -- Break headers into seperate entries
+ * alias_open() -- Map the compiled alias file, once
  */
-void header_parse(FILE *stream) {
-	size_t size = BUF_SZ, len = 0;
-	char *p = (char *)NULL, *q;
-	int in_header = 1;
-	char l = '\0';
+void alias_open() {
+	struct stat st;
+	char *db;
+	int fd;
+
+	if (alias_db.tried) {
+		return;
+	}
+	alias_db.tried = 1;
+
+	db = alias_db_file(aliases_file ? aliases_file : ALIASES_FILE);
+	if ((fd = open(db, O_RDONLY)) < 0) {
+		free(db);
+		return;
+	}
+
+	if (fstat(fd, &st) == 0 && st.st_size >= ALIAS_HDR_SZ) {
+		alias_db.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (alias_db.map == MAP_FAILED) {
+			alias_db.map = NULL;
+		}
+	}
+	close(fd);
+
+	if (alias_db.map) {
+		alias_db.size = st.st_size;
+		memcpy(&alias_db.slots, alias_db.map + 4, sizeof(uint32_t));
+
+		if (memcmp(alias_db.map, ALIAS_MAGIC, 4) != 0
+			|| alias_db.slots == 0 || (alias_db.slots & (alias_db.slots - 1))
+			|| (ALIAS_HDR_SZ + (alias_db.slots * 2 * sizeof(uint32_t))) > alias_db.size) {
+			log_event(LOG_ERR, "%s is corrupt, run newaliases", db);
+			munmap(alias_db.map, alias_db.size);
+			alias_db.map = NULL;
+		}
+	}
+	free(db);
+}
+
+/*
+ * alias_lookup() -- Find the targets of a local name
+ *	Returns the first of a list of NUL terminated targets closed by an
+ *	empty string, or NULL if the name is not an alias.
+ */
+char *alias_lookup(char *name) {
+	char lower[(BUF_SZ + 1)];
+	uint32_t *table, h, i, mask;
+	size_t n;
+
+	alias_open();
+	if (!alias_db.map) {
+		return (char *)NULL;
+	}
+
+	/* Keys are stored lowercased, hash the name the same way */
+	for (n = 0; name[n] && n < BUF_SZ; n++) {
+		lower[n] = tolower((unsigned char)name[n]);
+	}
+	if (name[n]) {
+		return (char *)NULL;
+	}
+	lower[n] = '\0';
+
+	table = (uint32_t *)(alias_db.map + ALIAS_HDR_SZ);
+	mask = (alias_db.slots - 1);
+	h = (uint32_t)rcpt_hash(lower);
+
+	for (i = (h & mask); table[(2 * i) + 1]; i = ((i + 1) & mask)) {
+		char *key = (char *)(alias_db.map + table[(2 * i) + 1]);
+
+		if (table[(2 * i) + 1] >= alias_db.size) {
+			return (char *)NULL;
+		}
+
+		if (table[2 * i] == h && strcmp(key, lower) == 0) {
+			return (key + strlen(key) + 1);
+		}
+	}
+
+	return (char *)NULL;
+}
+
+/*
+ * user_uid() -- Resolve a login name to its uid, -1 if unknown
+ *	Results are kept in a small direct mapped cache, so a list full of
+ *	local users does not hit the passwd database for every entry.
+ */
+long user_uid(char *name) {
+	struct uid_cache *e;
+	struct passwd *pw;
+
+	e = &uid_cache[rcpt_hash(name) % UID_CACHE_SZ];
+	if (e->name && strcmp(e->name, name) == 0) {
+		return e->uid;
+	}
+
+	free(e->name);
+	if ((e->name = strdup(name)) == (char *)NULL) {
+		die("user_uid() -- strdup() failed");
+	}
+	e->uid = ((pw = getpwnam(name)) ? (long)pw->pw_uid : -1);
+
+	return e->uid;
+}
+
+/*
+ * rcpt_add() -- Append a normalized address, resolving local names
+ *	Takes ownership of str. Local names are expanded through the alias map,
+ *	system accounts below minUserId are handed to root and whatever is left
+ *	is qualified with the sending domain.
+ */
+void rcpt_add(char *str, int depth) {
+	char *p;
+
+	if (strchr(str, '@') == (char *)NULL) {
+		if (rcpt_seen(str)) {
+			free(str);
+			return;
+		}
+
+		if (depth < ALIAS_DEPTH && (p = alias_lookup(str))) {
+			int self = 0;
+
+			for (; *p; p += strlen(p) + 1) {
+				if (strcasecmp(p, str) == 0) {
+					self = 1;
+					continue;
+				}
+
+				char *q = strdup(p);
+				if (q == (char *)NULL) {
+					die("rcpt_add() -- strdup() failed");
+				}
+				rcpt_add(q, (depth + 1));
+			}
+
+			/* Only an alias that lists itself is delivered as well */
+			if (!self) {
+				return;
+			}
+		}
+
+		if (cfg->root && *cfg->root && strcasecmp(str, cfg->root) != 0) {
+			long uid = user_uid(str);
+
+			if (uid >= 0 && uid < cfg->minuserid) {
+				if ((p = strdup(cfg->root)) == (char *)NULL) {
+					die("rcpt_add() -- strdup() failed");
+				}
+				rcpt_add(p, (depth + 1));
+				return;
+			}
+		}
+
+		char *qualify = (cfg->rewrite ? cfg->rewrite : cfg->domain);
+
+		if (!qualify) {
+			die("cannot qualify local recipient %s", str);
+		}
+
+		if ((p = malloc(strlen(str) + strlen(qualify) + 2)) == (char *)NULL) {
+			die("rcpt_add() -- malloc() failed");
+		}
+		sprintf(p, "%s@%s", str, qualify);
+
+		str = rcpt_normalize(p);
+		free(p);
+	}
+
+	if (rcpt_seen(str)) {
+		if (log_level > 0) {
+			log_event(LOG_INFO, "duplicate recipient \"%s\" dropped", str);
+		}
+		free(str);
+		return;
+	}
+	rt->string = str;
+	rcpt_count++;
+
+	rt->next = (rcpt_t *)malloc(sizeof(rcpt_t));
+	if (rt->next == (rcpt_t *)NULL) {
+		die("rcpt_add() -- malloc() failed");
+	}
+	rt = rt->next;
+
+	rt->next = (rcpt_t *)NULL;
+}
+
+/*
+ * rcpt_save() -- Store entry into RCPT list
+ */
+void rcpt_save(char *str) {
+	char *p;
+
+	/* Ignore missing usernames */
+	if (*str == '\0') {
+		return;
+	}
+
+#if 1
+	/* Horrible botch for group stuff */
+	p = str;
+	while(*p)
+		p++;
+
+	if(*--p == ';') {
+		return;
+	}
+#endif
+
+#if 0
+	fprintf(stdout, "*** rcpt_save(): str = [%s]\n", str);
+#endif
+
+	p = rcpt_normalize(str);
+	if (*p == '\0') {
+		free(p);
+		return;
+	}
+
+	rcpt_add(p, 0);
+}
+
+/*
+ * rcpt_parse() -- Break To|Cc|Bcc into individual addresses
+ */
+void rcpt_parse(char *str) {
+	int in_quotes = 0, got_addr = 0;
+	char *p, *q, *r;
+
+#if 0
+	fprintf(stdout, "*** rcpt_parse(): str = [%s]\n", str);
+#endif
+
+	if ((p = strdup(str)) == (char *)NULL) {
+		die("rcpt_parse(): strdup() failed");
+	}
+	q = p;
+
+	/* Replace <CR>, <LF> and <TAB> */
+	while (*q) {
+		switch (*q) {
+			case '\t':
+			case '\n':
+			case '\r':
+					*q = ' ';
+		}
+		q++;
+	}
+	q = p;
+
+#if 0
+	fprintf(stdout, "*** rcpt_parse(): q = [%s]\n", q);
+#endif
+
+	r = q;
+	while (*q) {
+		if (*q == '"') {
+			in_quotes = (in_quotes ? 0 : 1);
+		}
+
+		/* End of string? */
+		if (*(q + 1) == '\0') {
+			got_addr = 1;
+		}
+
+		/* End of address? */
+		if ((*q == ',') && (in_quotes == 0)) {
+			got_addr = 1;
+
+			*q = '\0';
+		}
+
+		if (got_addr) {
+			while (*r && isspace(*r))
+				r++;
+
+			rcpt_save(addr_parse(r));
+			r = (q + 1);
+#if 0
+			fprintf(stdout, "*** rcpt_parse(): r = [%s]\n", r);
+#endif
+			got_addr = 0;
+		}
+		q++;
+	}
+	free(p);
+}
+
+/*
+ * header_save() -- Store entry into header list
+ */
+void header_save(char *str) {
+	char *p;
+
+#if 0
+	fprintf(stdout, "header_save(): str = [%s]\n", str);
+#endif
+
+	if ((p = strdup(str)) == (char *)NULL) {
+		die("header_save() -- strdup() failed");
+	}
+	ht->string = p;
+
+	if (strncasecmp(ht->string, "From:", 5) == 0) {
+		/* Hack check for NULL From: line */
+		if (*(p + 6) == '\0') {
+			return;
+		}
+
+		if (cfg->override_from == 1) {
+			from = from_strip(ht->string);
+		}
+		have_from = 1;
+	} else if(strncasecmp(ht->string, "To:" ,3) == 0) {
+		have_to = 1;
+	} else if(strncasecmp(ht->string, "Date:", 5) == 0) {
+		have_date = 1;
+	} else if(strncasecmp(ht->string, "Message-ID:", 11) == 0) {
+		free(message_id);
+		if ((message_id = strdup(strip_pre_ws(ht->string + 11))) == (char *)NULL) {
+			die("header_save() -- strdup() failed");
+		}
+		if (*message_id) {
+			strip_post_ws(message_id);
+		}
+	}
+
+	if (minus_t) {
+		/* Need to figure out recipients from the e-mail */
+		if(strncasecmp(ht->string, "To:", 3) == 0) {
+			p = (ht->string + 3);
+			rcpt_parse(p);
+		} else if(strncasecmp(ht->string, "Bcc:", 4) == 0) {
+			p = (ht->string + 4);
+			rcpt_parse(p);
+           /* Undo adding the header to the list: */
+           free(ht->string);
+           ht->string = NULL;
+           return;
+		} else if(strncasecmp(ht->string, "CC:", 3) == 0) {
+			p = (ht->string + 3);
+			rcpt_parse(p);
+		}
+	}
+
+	/* Never pass Bcc: on to the API */
+	if (strncasecmp(ht->string, "Bcc:", 4) == 0) {
+		free(ht->string);
+		ht->string = NULL;
+		return;
+	}
+
+#if 0
+	fprintf(stdout, "header_save(): ht->string = [%s]\n", ht->string);
+#endif
+
+	ht->next = (headers_t *)calloc(1, sizeof(headers_t));
+	if (ht->next == (headers_t *)NULL) {
+		die("header_save() -- calloc() failed");
+	}
+	ht = ht->next;
+
+	ht->next = (headers_t *)NULL;
+}
+
+/*
+ * header_parse() -- Break headers into seperate entries
+ */
+void header_parse(FILE *stream) {
+	size_t size = BUF_SZ, len = 0;
+	char *p = (char *)NULL, *q;
+	int in_header = 1;
+	char l = '\0';
 	int c;
 
 	while (in_header && ((c = fgetc(stream)) != EOF)) {
@@ -501,265 +1871,5153 @@ void header_parse(FILE *stream) {
 
 						break;
 
-				case '\n':
-						in_header = 0;
+				case '\n':
+						in_header = 0;
+
+				default:
+						*q = '\0';
+						if((q = strrchr(p, '\n'))) {
+							*q = '\0';
+						}
+						header_save(p);
+
+						q = p;
+						len = 0;
+			}
+		}
+	}
+	free(p);
+}
+
+/*
+ * route_add() -- Parse "match domain api [endpoint] [rate]" from the config
+ *	match is @domain for the sender domain, Header:text for a header that
+ *	contains text, or else an exact envelope sender.
+ */
+void route_add(struct config *c, char *str) {
+	char *tok[5], *p, *save;
+	struct route *r, **rp;
+	int n = 0, i;
+
+	if ((str = strdup(str)) == (char *)NULL) {
+		die("route_add() -- strdup() failed");
+	}
+
+	for (p = strtok_r(str, " \t\n", &save); p && n < 5; p = strtok_r(NULL, " \t\n", &save)) {
+		tok[n++] = p;
+	}
+
+	if (n < 3) {
+		log_event(LOG_ERR, "route needs a match, domain and api key");
+		free(str);
+		return;
+	}
+
+	if ((r = (struct route *)calloc(1, sizeof(struct route))) == (struct route *)NULL) {
+		die("route_add() -- calloc() failed");
+	}
+
+	r->line = str;
+	r->match = tok[0];
+	r->domain = tok[1];
+	r->api = tok[2];
+
+	for (i = 3; i < n; i++) {
+		if (strncmp(tok[i], "http", 4) == 0) {
+			r->endpoint = tok[i];
+		} else {
+			r->rate = atof(tok[i]);
+		}
+	}
+
+	if (*r->match == '@') {
+		r->kind = ROUTE_SENDER_DOMAIN;
+		r->match++;
+	} else if (strchr(r->match, ':')) {
+		r->kind = ROUTE_HEADER;
+	} else {
+		r->kind = ROUTE_ENVELOPE;
+	}
+
+	if (r->kind != ROUTE_HEADER) {
+		for (p = r->match; *p; p++) {
+			*p = tolower((unsigned char)*p);
+		}
+	}
+
+	/* Keep config order, the first header route that matches wins */
+	for (rp = &c->routes; *rp; rp = &(*rp)->next);
+	*rp = r;
+
+	if (log_level > 0) {
+		log_event(LOG_INFO, "set route \"%s\" => %s\n", tok[0], r->domain);
+	}
+}
+
+/*
+ * lane_add() -- Parse "match high|normal|bulk" from the config
+ *	match is a sender address or @domain.
+ */
+void lane_add(struct config *c, char *str) {
+	char match[(BUF_SZ + 1)], name[16], *p;
+	struct lane_rule *l;
+	int lane;
+
+	if (sscanf(str, "%1024s %15s", match, name) != 2) {
+		log_event(LOG_ERR, "priority needs a sender and a lane");
+		return;
+	}
+
+	for (lane = 0; lane < LANE_MAX && strcasecmp(name, lane_name[lane]) != 0; lane++);
+	if (lane == LANE_MAX) {
+		log_event(LOG_ERR, "unknown priority lane %s", name);
+		return;
+	}
+
+	if ((l = (struct lane_rule *)calloc(1, sizeof(struct lane_rule))) == (struct lane_rule *)NULL
+		|| (l->match = strdup(match)) == (char *)NULL) {
+		die("lane_add() -- malloc() failed");
+	}
+	for (p = l->match; *p; p++) {
+		*p = tolower((unsigned char)*p);
+	}
+	l->lane = lane;
+
+	l->next = c->lanes;
+	c->lanes = l;
+
+	if (log_level > 0) {
+		log_event(LOG_INFO, "set priority \"%s\" => %s\n", l->match, lane_name[lane]);
+	}
+}
+
+/*
+ * now_wall_us() -- Wall clock in microseconds, comparable across processes
+ */
+int64_t now_wall_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+/*
+ * health_open() -- Map the shared endpoint health file
+ */
+void health_open(char *file) {
+	struct health_file *h;
+	int fd;
+
+	if ((fd = open(file, O_RDWR | O_CREAT, 0644)) < 0) {
+		log_event(LOG_ERR, "cannot open health file %s", file);
+		return;
+	}
+
+	if (ftruncate(fd, sizeof(struct health_file)) < 0) {
+		log_event(LOG_ERR, "cannot size health file %s", file);
+		close(fd);
+		return;
+	}
+
+	h = mmap(NULL, sizeof(struct health_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		log_event(LOG_ERR, "cannot map health file %s", file);
+		return;
+	}
+
+	if (h->magic[0] == '\0') {
+		memcpy(h->magic, HEALTH_MAGIC, sizeof(h->magic));
+	}
+
+	if (memcmp(h->magic, HEALTH_MAGIC, sizeof(h->magic)) != 0) {
+		log_event(LOG_ERR, "health file %s has unknown format", file);
+		munmap(h, sizeof(struct health_file));
+		return;
+	}
+
+	health_map = h;
+}
+
+/*
+ * health_slot() -- Health record of an endpoint URL
+ *	Slots are claimed with a compare and swap on the hash, a full table
+ *	falls back to a private record.
+ */
+struct health *health_slot(char *url) {
+	uint64_t h = rcpt_hash(url), mask = (HEALTH_SLOTS - 1), i, n;
+	struct health *hl;
+
+	{
+		for (i = (h & mask), n = 0; n < HEALTH_SLOTS; i = ((i + 1) & mask), n++) {
+			_Atomic uint64_t *slot = (_Atomic uint64_t *)&health_map->slot[i].hash;
+			uint64_t expect = 0;
+
+			if (atomic_load(slot) == h
+				|| atomic_compare_exchange_strong(slot, &expect, h)
+				|| expect == h) {
+				return &health_map->slot[i];
+			}
+		}
+		log_event(LOG_ERR, "health table full, %s tracked separately", url);
+	}
+
+	if ((hl = (struct health *)calloc(1, sizeof(struct health))) == (struct health *)NULL) {
+		die("health_slot() -- calloc() failed");
+	}
+	hl->hash = h;
+
+	return hl;
+}
+
+/*
+ * budget_open() -- Map the budget file of the queue directory, once
+ *	It is created group writable only, submitters share it through the
+ *	group of the queue directory. A process that cannot use it says so
+ *	and keeps within the budget on its own, in budget_local.
+ */
+void budget_open() {
+	char path[(BUF_SZ + 1)];
+	struct budget_file *b;
+	struct stat st;
+	int fd;
+
+	if (budget_ready) {
+		return;
+	}
+	budget_ready = 1;
+
+	/* Without O_CREAT first, sticky directories refuse it for files of
+	   other users. The group comes from a setgid queue directory. */
+	snprintf(path, sizeof(path), "%s/budget", queue_dir);
+	if ((fd = open(path, O_RDWR)) < 0 && errno == ENOENT
+		&& (fd = open(path, (O_RDWR | O_CREAT | O_EXCL), 0660)) >= 0) {
+		fchmod(fd, 0660);
+	}
+	if (fd < 0) {
+		log_event(LOG_ERR, "cannot open budget file %s, this process is limited on its own", path);
+		return;
+	}
+
+	/* Anyone could fill the slots of a world writable file */
+	if (fstat(fd, &st) == 0 && (st.st_mode & S_IWOTH) && fchmod(fd, (st.st_mode & 0770)) < 0) {
+		log_event(LOG_ERR, "budget file %s is world writable, this process is limited on its own", path);
+		close(fd);
+		return;
+	}
+
+	if (fstat(fd, &st) < 0
+		|| (st.st_size < (off_t)sizeof(struct budget_file)
+			&& ftruncate(fd, sizeof(struct budget_file)) < 0)) {
+		log_event(LOG_ERR, "cannot size budget file %s", path);
+		close(fd);
+		return;
+	}
+
+	b = mmap(NULL, sizeof(struct budget_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (b == MAP_FAILED) {
+		log_event(LOG_ERR, "cannot map budget file %s", path);
+		return;
+	}
+
+	if (b->magic[0] == '\0') {
+		memcpy(b->magic, BUDGET_MAGIC, sizeof(b->magic));
+	}
+
+	if (memcmp(b->magic, BUDGET_MAGIC, sizeof(b->magic)) != 0) {
+		log_event(LOG_ERR, "budget file %s has unknown format", path);
+		munmap(b, sizeof(struct budget_file));
+		return;
+	}
+
+	budget_map = b;
+}
+
+/*
+ * budget_on() -- Whether a budget is configured, opens the budget file the
+ *	first time
+ */
+int budget_on() {
+	if (!cfg->budget_bytes && !cfg->budget_msgs) {
+		return 0;
+	}
+	budget_open();
+
+	return 1;
+}
+
+/*
+ * budget_gone() -- Whether the process of a budget slot has exited, its
+ *	share is freed then
+ */
+int budget_gone(struct budget *b, int64_t pid) {
+	if (pid <= 0 || kill((pid_t)pid, 0) == 0 || errno != ESRCH) {
+		return 0;
+	}
+
+	if (atomic_compare_exchange_strong(&b->pid, &pid, -1)) {
+		atomic_store(&b->bytes, 0);
+		atomic_store(&b->msgs, 0);
+		atomic_store(&b->pid, 0);
+	}
+
+	return 1;
+}
+
+/*
+ * budget_slot() -- Budget slot of this process, claimed on first use
+ *	The pid is checked every time, the daemon forks after setup().
+ */
+struct budget *budget_slot() {
+	int64_t pid = getpid(), expect;
+	int i, pass;
+
+	if (budget_self && atomic_load(&budget_self->pid) == pid) {
+		return budget_self;
+	}
+
+	/* A free slot, or else one of a process that is gone */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < BUDGET_SLOTS; i++) {
+			if (pass) {
+				budget_gone(&budget_map->slot[i], atomic_load(&budget_map->slot[i].pid));
+			}
+
+			expect = 0;
+			if (atomic_compare_exchange_strong(&budget_map->slot[i].pid, &expect, pid)) {
+				budget_self = &budget_map->slot[i];
+				atomic_store(&budget_self->bytes, 0);
+				atomic_store(&budget_self->msgs, 0);
+				return budget_self;
+			}
+		}
+	}
+	log_event(LOG_ERR, "budget table full, this process is not limited by others");
+
+	if ((budget_self = (struct budget *)calloc(1, sizeof(struct budget))) == (struct budget *)NULL) {
+		die("budget_slot() -- calloc() failed");
+	}
+	budget_self->pid = pid;
+
+	return budget_self;
+}
+
+/*
+ * budget_used() -- Bytes and messages every process holds right now
+ */
+void budget_used(int64_t *bytes, int64_t *msgs) {
+	struct budget *b;
+	int i;
+
+	*bytes = 0;
+	*msgs = 0;
+
+	for (i = 0; i < BUDGET_SLOTS; i++) {
+		b = &budget_map->slot[i];
+		if (atomic_load_explicit(&b->msgs, memory_order_relaxed) == 0
+			|| budget_gone(b, atomic_load(&b->pid))) {
+			continue;
+		}
+		*bytes += atomic_load_explicit(&b->bytes, memory_order_relaxed);
+		*msgs += atomic_load_explicit(&b->msgs, memory_order_relaxed);
+	}
+
+	/* A process without a slot in the table only knows itself */
+	if (budget_self && (budget_self < budget_map->slot || budget_self >= (budget_map->slot + BUDGET_SLOTS))) {
+		*bytes += budget_self->bytes;
+		*msgs += budget_self->msgs;
+	}
+}
+
+/*
+ * budget_full() -- Whether the budget is nearly used up, submissions
+ *	are slowed down then
+ */
+int budget_full() {
+	int64_t bytes, msgs;
+
+	if (!budget_on()) {
+		return 0;
+	}
+	budget_used(&bytes, &msgs);
+
+	return ((cfg->budget_bytes && (bytes * 8) >= (cfg->budget_bytes * 7))
+		|| (cfg->budget_msgs && (msgs * 8) >= (cfg->budget_msgs * 7)));
+}
+
+/*
+ * budget_take() -- Reserve memory for a message about to be held
+ *	Returns 0 when it does not fit, the caller spools the message
+ *	instead. A message alone may exceed the budget. Processes check and
+ *	reserve without a lock, so the budget can overshoot by the messages
+ *	that raced for its last bytes.
+ */
+int budget_take(int64_t bytes) {
+	struct budget *self;
+	int64_t used, msgs;
+
+	if (!budget_on()) {
+		return 1;
+	}
+	self = budget_slot();
+	budget_used(&used, &msgs);
+	if (msgs > 0 && ((cfg->budget_bytes && (used + bytes) > cfg->budget_bytes)
+		|| (cfg->budget_msgs && (msgs + 1) > cfg->budget_msgs))) {
+		return 0;
+	}
+
+	atomic_fetch_add(&self->bytes, bytes);
+	atomic_fetch_add(&self->msgs, 1);
+
+	return 1;
+}
+
+/*
+ * budget_grow() -- Reserve more bytes for a message already taken
+ *	Returns 0 when they do not fit.
+ */
+int budget_grow(int64_t bytes) {
+	struct budget *self;
+	int64_t used, msgs;
+
+	if (!budget_on()) {
+		return 1;
+	}
+	self = budget_slot();
+	budget_used(&used, &msgs);
+	if (cfg->budget_bytes && (used + bytes) > cfg->budget_bytes) {
+		return 0;
+	}
+	atomic_fetch_add(&self->bytes, bytes);
+
+	return 1;
+}
+
+/*
+ * budget_put() -- Return what budget_take() and budget_grow() reserved
+ */
+void budget_put(int64_t bytes) {
+	struct budget *self;
+
+	/* Nothing was taken while no budget was configured */
+	if (!budget_self || !budget_on()) {
+		return;
+	}
+	self = budget_slot();
+
+	atomic_fetch_sub(&self->bytes, bytes);
+	atomic_fetch_sub(&self->msgs, 1);
+}
+
+/*
+ * budget_wait() -- Hold a submission back while the budget is nearly used
+ *	up, for at most BUDGET_WAIT. The sender blocks on its pipe meanwhile.
+ */
+void budget_wait() {
+	int waited;
+
+	for (waited = 0; waited < BUDGET_WAIT && budget_full(); waited += 50) {
+		usleep(50000);
+	}
+}
+
+/*
+ * budget_close() -- Give up the budget slot of this process
+ */
+void budget_close() {
+	if (budget_self && budget_self >= budget_map->slot && budget_self < (budget_map->slot + BUDGET_SLOTS)
+		&& atomic_load(&budget_self->pid) == getpid()) {
+		atomic_store(&budget_self->bytes, 0);
+		atomic_store(&budget_self->msgs, 0);
+		atomic_store(&budget_self->pid, 0);
+	} else if (budget_self && (budget_self < budget_map->slot || budget_self >= (budget_map->slot + BUDGET_SLOTS))) {
+		free(budget_self);
+	}
+	budget_self = NULL;
+}
+
+/*
+ * endpoint_score() -- Expected cost of an endpoint, lower is better
+ *	Errors are weighted heavily, an endpoint that answers quickly but
+ *	fails half the time is worse than a slow healthy one.
+ */
+double endpoint_score(struct endpoint *ep) {
+	double ewma = atomic_load_explicit(&ep->health->ewma_us, memory_order_relaxed);
+	double err = (atomic_load_explicit(&ep->health->err_ppm, memory_order_relaxed) / 1e6);
+
+	/* Never answered, assume it takes as long as a connect timeout */
+	if (ewma == 0 && err > 0) {
+		ewma = (CONNECT_TIMEOUT * 1000.0);
+	}
+
+	return (ewma * (1 + (10 * err)));
+}
+
+/*
+ * endpoint_select() -- Fastest healthy endpoint not yet tried
+ *	Endpoints without a sample yet score 0 and get tried first. When every
+ *	endpoint is out of rotation the one coming back soonest is used.
+ */
+struct endpoint *endpoint_select(struct route *r, int tried) {
+	struct endpoint *best = (struct endpoint *)NULL, *soonest = (struct endpoint *)NULL;
+	int64_t now = now_wall_us(), down;
+	int i;
+
+	for (i = 0; i < r->nep; i++) {
+		struct endpoint *ep = &r->ep[i];
+
+		if (tried & (1 << i)) {
+			continue;
+		}
+
+		down = atomic_load_explicit(&ep->health->down_until, memory_order_relaxed);
+		if (down > now) {
+			if (!soonest || down < atomic_load(&soonest->health->down_until)) {
+				soonest = ep;
+			}
+			continue;
+		}
+
+		if (!best || endpoint_score(ep) < endpoint_score(best)) {
+			best = ep;
+		}
+	}
+
+	return (best ? best : soonest);
+}
+
+/*
+ * endpoint_update() -- Feed the outcome of a request into the averages
+ */
+void endpoint_update(struct endpoint *ep, int failed, uint64_t total) {
+	struct health *h = ep->health;
+	int64_t ewma, err;
+
+	if (!failed) {
+		ewma = atomic_load_explicit(&h->ewma_us, memory_order_relaxed);
+		ewma = (ewma ? (int64_t)((ENDPOINT_ALPHA * total) + ((1 - ENDPOINT_ALPHA) * ewma)) : (int64_t)total);
+		atomic_store_explicit(&h->ewma_us, (ewma ? ewma : 1), memory_order_relaxed);
+	}
+
+	err = atomic_load_explicit(&h->err_ppm, memory_order_relaxed);
+	err = (int64_t)(((failed ? 1e6 : 0) * ENDPOINT_ALPHA) + ((1 - ENDPOINT_ALPHA) * err));
+	atomic_store_explicit(&h->err_ppm, err, memory_order_relaxed);
+
+	if (!failed) {
+		atomic_store_explicit(&h->fails, 0, memory_order_relaxed);
+		atomic_store_explicit(&h->down_until, 0, memory_order_relaxed);
+	} else if (atomic_fetch_add(&h->fails, 1) + 1 >= ENDPOINT_FAILS) {
+		atomic_store_explicit(&h->down_until, (now_wall_us() + ENDPOINT_BACKOFF), memory_order_relaxed);
+		log_event(LOG_INFO, "endpoint %s out of rotation", ep->url);
+	}
+}
+
+/*
+ * endpoint_url() -- Endpoint URL with the domain in place of its %s
+ *	A URL may hold at most one %s and no other %, else NULL.
+ */
+char *endpoint_url(char *tmpl, char *domain) {
+	char *url, *p = strchr(tmpl, '%');
+	size_t pre, len;
+
+	if (p && (p[1] != 's' || strchr(p + 2, '%'))) {
+		return (char *)NULL;
+	}
+
+	pre = (p ? (size_t)(p - tmpl) : strlen(tmpl));
+	len = (pre + (p ? (strlen(domain) + strlen(p + 2)) : 0));
+	if ((url = (char *)malloc(len + 1)) == (char *)NULL) {
+		die("endpoint_url() -- malloc() failed");
+	}
+
+	memcpy(url, tmpl, pre);
+	if (p) {
+		memcpy(url + pre, domain, strlen(domain));
+		memcpy(url + pre + strlen(domain), p + 2, strlen(p + 2));
+	}
+	url[len] = '\0';
+
+	return url;
+}
+
+/*
+ * route_compile() -- Build URLs and credentials of a route
+ */
+void route_compile(struct config *c, struct route *r) {
+	if (!r->endpoint) {
+		r->endpoint = c->endpoint;
+	}
+
+	char *list, *p, *save;
+
+	if ((list = strdup(r->endpoint)) == (char *)NULL) {
+		die("route_compile() -- strdup() failed");
+	}
+
+	for (p = strtok_r(list, ",", &save); p && r->nep < ROUTE_ENDPOINTS; p = strtok_r(NULL, ",", &save)) {
+		struct endpoint *ep = &r->ep[r->nep];
+
+		if ((ep->url = endpoint_url(p, r->domain)) == (char *)NULL) {
+			log_event(LOG_ERR, "endpoint \"%s\" ignored, it may only hold one %%s", p);
+			continue;
+		}
+		ep->health = health_slot(ep->url);
+		r->nep++;
+	}
+	free(list);
+
+	if ((r->userpwd = (char *)malloc(strlen(r->api) + 5)) == (char *)NULL) {
+		die("route_compile() -- malloc() failed");
+	}
+	sprintf(r->userpwd, "api:%s", r->api);
+
+	r->tokens = (r->rate > 1 ? r->rate : 1);
+	r->last = now_us();
+}
+
+/*
+ * route_insert() -- Add an envelope or domain route to the lookup table
+ */
+void route_insert(struct config *c, struct route *r) {
+	unsigned long i, mask;
+
+	if (c->route_table.count * 4 >= c->route_table.size * 3) {
+		struct route_table old = c->route_table;
+
+		c->route_table.size = (old.size ? (old.size * 2) : ROUTE_TABLE_SZ);
+		c->route_table.count = 0;
+		c->route_table.slot = (struct route **)calloc(c->route_table.size, sizeof(struct route *));
+		if (c->route_table.slot == (struct route **)NULL) {
+			die("route_insert() -- calloc() failed");
+		}
+
+		for (i = 0; i < old.size; i++) {
+			if (old.slot[i]) {
+				route_insert(c, old.slot[i]);
+			}
+		}
+		free(old.slot);
+	}
+
+	mask = (c->route_table.size - 1);
+	for (i = (rcpt_hash(r->match) & mask); c->route_table.slot[i]; i = ((i + 1) & mask)) {
+		if (strcmp(c->route_table.slot[i]->match, r->match) == 0) {
+			log_event(LOG_ERR, "duplicate route \"%s\" ignored", r->match);
+			return;
+		}
+	}
+	c->route_table.slot[i] = r;
+	c->route_table.count++;
+}
+
+/*
+ * route_setup() -- Compile the default route and every configured route
+ */
+void route_setup(struct config *c) {
+	struct route *r;
+
+	c->default_route.kind = ROUTE_DEFAULT;
+	c->default_route.domain = c->domain;
+	c->default_route.api = c->api;
+	c->default_route.endpoint = c->endpoint;
+	route_compile(c, &c->default_route);
+
+	for (r = c->routes; r; r = r->next) {
+		route_compile(c, r);
+		if (r->kind != ROUTE_HEADER) {
+			route_insert(c, r);
+		}
+	}
+}
+
+/*
+ * route_find() -- Table lookup of a lowercased envelope address or domain
+ */
+struct route *route_find(struct config *c, char *key) {
+	unsigned long i, mask;
+
+	if (!c->route_table.size) {
+		return (struct route *)NULL;
+	}
+
+	mask = (c->route_table.size - 1);
+	for (i = (rcpt_hash(key) & mask); c->route_table.slot[i]; i = ((i + 1) & mask)) {
+		if (strcmp(c->route_table.slot[i]->match, key) == 0) {
+			return c->route_table.slot[i];
+		}
+	}
+
+	return (struct route *)NULL;
+}
+
+/*
+ * message_from() -- Lowercased sender of the current message, -f or From:
+ */
+char *message_from() {
+	char *sender = (char *)NULL, *p;
+
+	if (minus_f) {
+		sender = rcpt_normalize(addr_parse(minus_f));
+	} else {
+		for (ht = &headers; ht->next; ht = ht->next) {
+			if (ht->string && strncasecmp(ht->string, "From:", 5) == 0) {
+				p = from_strip(ht->string);
+				sender = rcpt_normalize(p);
+				free(p);
+				break;
+			}
+		}
+	}
+
+	for (p = sender; p && *p; p++) {
+		*p = tolower((unsigned char)*p);
+	}
+
+	return sender;
+}
+
+/*
+ * route_select() -- Pick the route for the current message
+ *	Exact envelope sender first, then header rules, then the sender domain.
+ */
+struct route *route_select(struct config *c) {
+	struct route *r;
+	char *sender, *p;
+
+	if (!c->routes) {
+		return &c->default_route;
+	}
+
+	if ((sender = message_from())) {
+		if ((r = route_find(c, sender))) {
+			free(sender);
+			return r;
+		}
+	}
+
+	for (r = c->routes; r; r = r->next) {
+		if (r->kind != ROUTE_HEADER) {
+			continue;
+		}
+
+		p = strchr(r->match, ':');
+		for (ht = &headers; ht->next; ht = ht->next) {
+			if (ht->string && strncasecmp(ht->string, r->match, (p - r->match + 1)) == 0
+				&& strcasestr(ht->string + (p - r->match + 1), (p + 1))) {
+				free(sender);
+				return r;
+			}
+		}
+	}
+
+	if (sender && (p = strrchr(sender, '@')) && (r = route_find(c, p + 1))) {
+		free(sender);
+		return r;
+	}
+
+	free(sender);
+
+	return &c->default_route;
+}
+
+/*
+ * net_init() -- Bring up libcurl and its TLS backend on first use
+ *	Spooling with -odq, newaliases and the lookups never need the network.
+ */
+void net_init() {
+	if (!net_ready) {
+		/* In windows, this will init the winsock stuff */
+		curl_global_init(CURL_GLOBAL_ALL);
+		net_ready = 1;
+	}
+}
+
+/*
+ * message_lane() -- Priority lane of the current message
+ *	A priority= rule for the sender wins, then Precedence: bulk, list or
+ *	junk and X-Priority: 4 or 5 make it bulk, X-Priority: 1 or 2 high.
+ */
+int message_lane(struct config *c) {
+	struct lane_rule *l;
+	char *sender, *at, *p;
+	int lane = LANE_NORMAL;
+
+	if (c->lanes && (sender = message_from())) {
+		at = strrchr(sender, '@');
+		for (l = c->lanes; l; l = l->next) {
+			if (strcmp(l->match, sender) == 0 || (at && strcmp(l->match, at) == 0)) {
+				free(sender);
+				return l->lane;
+			}
+		}
+		free(sender);
+	}
+
+	for (ht = &headers; ht->next; ht = ht->next) {
+		if (!ht->string) {
+			continue;
+		}
+
+		if (strncasecmp(ht->string, "Precedence:", 11) == 0) {
+			p = strip_pre_ws(ht->string + 11);
+			if (strncasecmp(p, "bulk", 4) == 0 || strncasecmp(p, "list", 4) == 0
+				|| strncasecmp(p, "junk", 4) == 0) {
+				return LANE_BULK;
+			}
+		} else if (strncasecmp(ht->string, "X-Priority:", 11) == 0) {
+			p = strip_pre_ws(ht->string + 11);
+			if (*p == '1' || *p == '2') {
+				lane = LANE_HIGH;
+			} else if (*p == '4' || *p == '5') {
+				lane = LANE_BULK;
+			}
+		}
+	}
+
+	return lane;
+}
+
+/*
+ * route_handle() -- Take an idle connection to the endpoint or open one
+ */
+CURL *route_handle(struct endpoint *ep) {
+	if (ep->idle > 0) {
+		return ep->pool[--ep->idle].curl;
+	}
+
+	net_init();
+
+	return curl_easy_init();
+}
+
+/*
+ * route_release() -- Give a connection back to the endpoint pool
+ *	curl_easy_reset() drops the options but keeps the live connection.
+ */
+void route_release(struct endpoint *ep, CURL *curl) {
+	if (ep->idle < ROUTE_POOL) {
+		curl_easy_reset(curl);
+		ep->pool[ep->idle].curl = curl;
+		ep->pool[ep->idle++].used = now_us();
+	} else {
+		curl_easy_cleanup(curl);
+	}
+}
+
+/*
+ * route_probe() -- Cheap HEAD request over a pooled connection
+ *	Opens the connection and completes TLS when there is none yet, and
+ *	proves an idle one is still alive. The connection stays in the handle.
+ */
+int route_probe(struct route *r, struct endpoint *ep, CURL *curl) {
+	CURLcode res;
+
+	curl_easy_setopt(curl, CURLOPT_URL, ep->url);
+	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
+	curl_easy_setopt(curl, CURLOPT_USERPWD, r->userpwd);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)CONNECT_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)CONNECT_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+	res = curl_easy_perform(curl);
+	curl_easy_reset(curl);
+
+	if (res != CURLE_OK) {
+		log_event(LOG_INFO, "probe of %s failed: %s", ep->url, curl_easy_strerror(res));
+		endpoint_update(ep, 1, 0);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * route_maintain() -- Keep prewarm connections per endpoint ready
+ *	Connections idle for keepAlive seconds are probed before the server
+ *	closes them, dead ones are dropped and replaced, so sporadic mail
+ *	finds a warm connection just like a steady stream does.
+ */
+void route_maintain(struct config *c) {
+	struct route *r = &c->default_route;
+	uint64_t now = now_us();
+	struct endpoint *ep;
+	CURL *curl;
+	int i, j;
+
+	for (; r; r = ((r == &c->default_route) ? c->routes : r->next)) {
+		for (i = 0; i < r->nep; i++) {
+			ep = &r->ep[i];
+
+			for (j = 0; j < ep->idle; j++) {
+				if ((now - ep->pool[j].used) < (uint64_t)(c->keepalive * 1000000)) {
+					continue;
+				}
+
+				if (route_probe(r, ep, ep->pool[j].curl)) {
+					ep->pool[j].used = now_us();
+				} else {
+					curl_easy_cleanup(ep->pool[j].curl);
+					ep->pool[j--] = ep->pool[--ep->idle];
+				}
+			}
+
+			/* Skip endpoints out of rotation, no point in hammering them */
+			if (atomic_load(&ep->health->down_until) > now_wall_us()) {
+				continue;
+			}
+
+			while (ep->idle < c->prewarm && ep->idle < ROUTE_POOL) {
+				net_init();
+
+				if ((curl = curl_easy_init()) == (CURL *)NULL) {
+					break;
+				}
+
+				if (!route_probe(r, ep, curl)) {
+					curl_easy_cleanup(curl);
+					break;
+				}
+				ep->pool[ep->idle].curl = curl;
+				ep->pool[ep->idle++].used = now_us();
+			}
+		}
+	}
+}
+
+/*
+ * route_token() -- Take a token of the route rate budget if there is one
+ *	Returns 0 when taken, or else the microseconds until the next token.
+ */
+uint64_t route_token(struct route *r) {
+	double burst = (r->rate > 1 ? r->rate : 1);
+	uint64_t now;
+
+	if (r->rate <= 0) {
+		return 0;
+	}
+
+	now = now_us();
+	r->tokens += (((now - r->last) * r->rate) / 1e6);
+	if (r->tokens > burst) {
+		r->tokens = burst;
+	}
+	r->last = now;
+
+	if (r->tokens >= 1) {
+		r->tokens -= 1;
+		return 0;
+	}
+
+	return ((uint64_t)(((1 - r->tokens) * 1e6) / r->rate) + 1);
+}
+
+/*
+ * route_throttle() -- Wait for a token of the route rate budget
+ */
+void route_throttle(struct route *r) {
+	uint64_t wait;
+
+	while ((wait = route_token(r)) > 0) {
+		usleep((useconds_t)wait);
+	}
+}
+
+/*
+ * This is much like strtok, but does not modify the string
+ * argument.
+ * Args:
+ * 	char **s:
+ * 		Address of the pointer to the string we are looking at.
+ * 	const char *delim:
+ * 		The set of delimiters.
+ * Return value:
+ *	The first token, copied by strndup (caller have to free it),
+ * 	if a token is found, or NULL if isn't (os strndup fails)
+ * 	*s points to the rest of the string
+ */
+char *firsttok(char **s, const char *delim) {
+	char *tok;
+	char *rest;
+	rest = strpbrk(*s, delim);
+	if (!rest) {
+		return NULL;
+	}
+
+	tok = _strndup(*s,rest-(*s));
+	if (!tok) {
+		die("firsttok() -- strndup() failed");
+	}
+	*s = rest + 1;
+	return tok;
+}
+
+/*
+ * read_config() -- Open and parse config file and extract values of variables
+ */
+int read_config(struct config *c) {
+	char buf[(BUF_SZ + 1)], *p, *q, *r;
+	FILE *fp;
+
+	if (config_file == (char *)NULL) {
+		config_file = strdup(CONFIGURATION_FILE);
+		if (config_file == (char *)NULL) {
+			die("read_config() -- strdup() failed");
+		}
+	}
+
+	if ((fp = fopen(config_file, "r")) == NULL) {
+		return 0;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		char *begin = buf;
+		char *rightside;
+
+		/* Make comments invisible */
+		if ((p = strchr(buf, '#'))) {
+			*p = '\0';
+		}
+
+		/* Ignore malformed lines and comments */
+		if (strchr(buf, '=') == (char *)NULL)
+			continue;
+
+		/* Parse out keywords */
+		p = firsttok(&begin, "= \t\n");
+		if (p) {
+			rightside=begin;
+			q = firsttok(&begin, "= \t\n");
+		}
+
+		if (p && q) {
+			if (strcasecmp(p, "root") == 0) {
+				free(c->root);
+				if ((c->root = strdup(q)) == (char *)NULL) {
+					die("read_config() -- strdup() failed");
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set root=\"%s\"\n", c->root);
+				}
+			} else if (strcasecmp(p, "minUserId") == 0) {
+				if((r = strdup(q)) == (char *)NULL) {
+					die("read_config() -- strdup() failed");
+				}
+
+				c->minuserid = atoi(r);
+
+				if(log_level > 0) {
+					log_event(LOG_INFO, "set minUserId=\"%d\"\n", c->minuserid);
+				}
+			} else if (strcasecmp(p, "api") == 0) {
+				free(c->api);
+				if ((c->api = strdup(q)) == (char *)NULL) {
+					die("read_config() -- strdup() failed");
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set api=\"%s\"\n", c->api);
+				}
+			} else if (strcasecmp(p, "rewriteDomain") == 0) {
+				free(c->rewrite);
+				if ((r = strrchr(q, '@'))) {
+					c->rewrite = strdup(++r);
+
+					log_event(LOG_ERR,
+						"set rewriteDomain=\"%s\" is invalid\n", q);
+					log_event(LOG_ERR,
+						"set rewriteDomain=\"%s\" used\n", c->rewrite);
+				} else {
+					c->rewrite = strdup(q);
+				}
+
+				if (c->rewrite == (char *)NULL) {
+					die("read_config() -- strdup() failed");
+				}
+
+				c->rewrite_domain = 1;
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set rewriteDomain=\"%s\"\n", c->rewrite);
+				}
+			} else if (strcasecmp(p, "route") == 0) {
+				route_add(c, rightside);
+			} else if (strcasecmp(p, "priority") == 0) {
+				lane_add(c, rightside);
+			} else if (strcasecmp(p, "fairness") == 0) {
+				c->fair_sender = (strcasecmp(q, "sender") == 0);
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set fairness=\"%s\"\n", (c->fair_sender ? "sender" : "uid"));
+				}
+			} else if(strcasecmp(p, "fromLineOverride") == 0) {
+				if (strcasecmp(q, "yes") == 0) {
+					c->override_from = 1;
+				} else {
+					c->override_from = 0;
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set fromLineOverride=\"%s\"\n",
+						c->override_from ? "True" : "False");
+				}
+			} else if (strcasecmp(p, "domain") == 0) {
+				free(c->domain);
+				if ((c->domain = strdup(q)) == (char *)NULL) {
+					die("read_config() -- strdup() failed");
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set domain=\"%s\"\n", c->domain);
+				}
+			} else if (strcasecmp(p, "endpoint") == 0) {
+				free(c->endpoint);
+				if ((c->endpoint = strdup(q)) == (char *)NULL) {
+					die("read_config() -- strdup() failed");
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set endpoint=\"%s\"\n", c->endpoint);
+				}
+			} else if (strcasecmp(p, "trace") == 0) {
+				if (trace_file == (char *)NULL) {
+					if ((trace_file = strdup(q)) == (char *)NULL) {
+						die("read_config() -- strdup() failed");
+					}
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set trace=\"%s\"\n", trace_file);
+				}
+			} else if (strcasecmp(p, "journal") == 0) {
+				if (journal_file == (char *)NULL) {
+					if ((journal_file = strdup(q)) == (char *)NULL) {
+						die("read_config() -- strdup() failed");
+					}
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set journal=\"%s\"\n", journal_file);
+				}
+			} else if (strcasecmp(p, "health") == 0) {
+				if (health_file == (char *)NULL) {
+					if ((health_file = strdup(q)) == (char *)NULL) {
+						die("read_config() -- strdup() failed");
+					}
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set health=\"%s\"\n", health_file);
+				}
+			} else if (strcasecmp(p, "timeout") == 0) {
+				if ((c->timeout = atol(q)) <= 0) {
+					c->timeout = 60;
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set timeout=\"%ld\"\n", c->timeout);
+				}
+			} else if (strcasecmp(p, "queue") == 0) {
+				if (queue_dir == (char *)NULL) {
+					if ((queue_dir = strdup(q)) == (char *)NULL) {
+						die("read_config() -- strdup() failed");
+					}
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set queue=\"%s\"\n", queue_dir);
+				}
+			} else if (strcasecmp(p, "compress") == 0) {
+				if ((c->compress = atol(q)) < 0) {
+					c->compress = 0;
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set compress=\"%ld\"\n", c->compress);
+				}
+			} else if (strcasecmp(p, "memoryBudget") == 0) {
+				if ((c->budget_bytes = atol(q)) < 0) {
+					c->budget_bytes = 0;
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set memoryBudget=\"%ld\"\n", c->budget_bytes);
+				}
+			} else if (strcasecmp(p, "messageBudget") == 0) {
+				if ((c->budget_msgs = atol(q)) < 0) {
+					c->budget_msgs = 0;
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set messageBudget=\"%ld\"\n", c->budget_msgs);
+				}
+			} else if (strcasecmp(p, "prewarm") == 0) {
+				c->prewarm = atoi(q);
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set prewarm=\"%d\"\n", c->prewarm);
+				}
+			} else if (strcasecmp(p, "keepAlive") == 0) {
+				if ((c->keepalive = atol(q)) <= 0) {
+					c->keepalive = 50;
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set keepAlive=\"%ld\"\n", c->keepalive);
+				}
+			} else if (strcasecmp(p, "stats") == 0) {
+				if (stats_file == (char *)NULL) {
+					if ((stats_file = strdup(q)) == (char *)NULL) {
+						die("read_config() -- strdup() failed");
+					}
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set stats=\"%s\"\n", stats_file);
+				}
+			} else if (strcasecmp(p, "aliases") == 0) {
+				if (aliases_file == (char *)NULL) {
+					if ((aliases_file = strdup(q)) == (char *)NULL) {
+						die("read_config() -- strdup() failed");
+					}
+				}
+
+				if (log_level > 0) {
+					log_event(LOG_INFO, "set aliases=\"%s\"\n", aliases_file);
+				}
+			} else if (strcasecmp(p, "debug") == 0) {
+				if (strcasecmp(q, "yes") == 0) {
+					log_level = 1;
+				} else {
+					log_level = 0;
+				}
+			} else {
+				log_event(LOG_INFO, "unable to set %s=\"%s\"\n", p, q);
+			}
+			free(p);
+			free(q);
+		}
+	}
+	fclose(fp);
+
+	return 1;
+}
+
+/*
+ * config_new() -- Config with the built in defaults
+ */
+struct config *config_new() {
+	struct config *c;
+
+	if ((c = (struct config *)calloc(1, sizeof(struct config))) == (struct config *)NULL) {
+		die("config_new() -- calloc() failed");
+	}
+
+	if ((c->endpoint = strdup(ENDPOINT)) == (char *)NULL) {
+		die("config_new() -- strdup() failed");
+	}
+
+	c->refs = 1;
+	c->timeout = 60;
+	c->keepalive = 50;
+	c->compress = SPOOL_COMPRESS;
+	c->budget_bytes = BUDGET_BYTES;
+	c->budget_msgs = BUDGET_MSGS;
+
+	return c;
+}
+
+/*
+ * config_read() -- Parse the config file into a new config
+ */
+struct config *config_read() {
+	struct config *c = config_new();
+
+	if (!read_config(c)) {
+		log_event(LOG_INFO, "%s not found", config_file);
+	}
+
+	return c;
+}
+
+/*
+ * route_free() -- Release what route_add() and route_compile() allocated
+ */
+void route_free(struct route *r) {
+	int i;
+
+	for (i = 0; i < r->nep; i++) {
+		while (r->ep[i].idle > 0) {
+			curl_easy_cleanup(r->ep[i].pool[--r->ep[i].idle].curl);
+		}
+		free(r->ep[i].url);
+	}
+	free(r->userpwd);
+	free(r->line);
+}
+
+/*
+ * config_free() -- Drop a config nobody references anymore
+ */
+void config_free(struct config *c) {
+	struct route *r, *next;
+
+	route_free(&c->default_route);
+	for (r = c->routes; r; r = next) {
+		next = r->next;
+		route_free(r);
+		free(r);
+	}
+	free(c->route_table.slot);
+
+	while (c->lanes) {
+		struct lane_rule *l = c->lanes;
+
+		c->lanes = l->next;
+		free(l->match);
+		free(l);
+	}
+
+	free(c->api);
+	free(c->domain);
+	free(c->rewrite);
+	free(c->endpoint);
+	free(c->root);
+	free(c);
+}
+
+/*
+ * config_acquire() -- Pin the published config
+ *	Reloads happen on the thread that delivers, between messages, so the
+ *	config cannot be freed between the load and the increment.
+ */
+struct config *config_acquire() {
+	struct config *c = atomic_load(&config_live);
+
+	atomic_fetch_add(&c->refs, 1);
+
+	return c;
+}
+
+/*
+ * config_release() -- Unpin a config, the last reference frees it
+ */
+void config_release(struct config *c) {
+	if (c && atomic_fetch_sub(&c->refs, 1) == 1) {
+		config_free(c);
+	}
+}
+
+/*
+ * url_origin() -- Length of the scheme://host:port part of a URL
+ */
+size_t url_origin(char *url) {
+	char *p;
+
+	if ((p = strstr(url, "://")) == (char *)NULL) {
+		return strlen(url);
+	}
+	p += 3;
+
+	return ((p - url) + strcspn(p, "/"));
+}
+
+/*
+ * config_adopt() -- Hand idle connections over to a new config
+ *	Only idle connections move, requests in flight keep theirs and return
+ *	them to the old config, which closes them when it is released.
+ */
+void config_adopt(struct config *c, struct config *old) {
+	struct route *r = &c->default_route, *o;
+	struct endpoint *ep, *oep;
+	int i, j;
+
+	for (; r; r = ((r == &c->default_route) ? c->routes : r->next)) {
+		for (i = 0; i < r->nep; i++) {
+			ep = &r->ep[i];
+
+			for (o = &old->default_route; o; o = ((o == &old->default_route) ? old->routes : o->next)) {
+				for (j = 0; j < o->nep; j++) {
+					oep = &o->ep[j];
+
+					/* Connections are authenticated per request, only the origin matters */
+					if (url_origin(ep->url) != url_origin(oep->url) || strncmp(ep->url, oep->url, url_origin(ep->url)) != 0) {
+						continue;
+					}
+
+					while (oep->idle > 0 && ep->idle < ROUTE_POOL) {
+						ep->pool[ep->idle++] = oep->pool[--oep->idle];
+					}
+				}
+			}
+		}
+	}
+}
+
+/*
+ * config_publish() -- Make a compiled config the one new deliveries use
+ */
+void config_publish(struct config *c) {
+	struct config *old = atomic_load(&config_live);
+
+	if (old) {
+		config_adopt(c, old);
+	}
+
+	old = atomic_exchange(&config_live, c);
+	config_release(old);
+}
+
+/*
+ * canon_scalar() -- Canonicalize body bytes one at a time
+ *	Bare \n becomes \r\n, with CANON_UNSTUFF a stuffed leading dot is
+ *	dropped, and the line lengths and 8-bit bytes are noted. out must
+ *	hold 2 * n bytes.
+ *	Returns the bytes written.
+ */
+size_t canon_scalar(struct canon *c, const unsigned char *in, size_t n, char *out) {
+	char *o = out;
+	size_t i;
+	int ch;
+
+	for (i = 0; i < n && c->state != CANON_END; i++) {
+		ch = in[i];
+
+		if (c->state == CANON_DOT) {
+			c->state = CANON_TEXT;
+			if (ch == '\n') {
+				c->state = CANON_END;
+				break;
+			} else if (ch == '\r') {
+				c->state = CANON_DOTCR;
+				continue;
+			} else if (ch != '.' || !(c->flags & CANON_UNSTUFF)) {
+				/* Not stuffed, or not ours to unstuff, keep the dot */
+				*o++ = '.';
+				c->line++;
+			}
+		} else if (c->state == CANON_DOTCR) {
+			c->state = CANON_TEXT;
+			if (ch == '\n') {
+				c->state = CANON_END;
+				break;
+			}
+			*o++ = '.';
+			*o++ = '\r';
+			c->line += 2;
+			c->cr = 1;
+		} else if (c->state == CANON_BOL && ch == '.' && (c->flags & (CANON_DOTEND | CANON_UNSTUFF))) {
+			c->state = CANON_DOT;
+			continue;
+		}
+
+		if (ch == '\n') {
+			if (!c->cr) {
+				*o++ = '\r';
+			}
+			*o++ = '\n';
+
+			if ((c->line - c->cr) > BODY_LINE_MAX) {
+				c->longline = 1;
+			}
+			c->line = 0;
+			c->cr = 0;
+			c->state = CANON_BOL;
+			continue;
+		}
+
+		*o++ = ch;
+		c->state = CANON_TEXT;
+		c->cr = (ch == '\r');
+		c->eightbit |= (ch >> 7);
+		c->line++;
+	}
+
+	return (o - out);
+}
+
+#ifdef __SSE2__
+/*
+ * canon_sse2() -- canon_scalar() that copies 16 bytes at a time up to the
+ *	next \n, leaving line starts and line ends to the scalar code.
+ *	out must hold 2 * n + CANON_SLACK bytes.
+ */
+size_t canon_sse2(struct canon *c, const unsigned char *in, size_t n, char *out) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	char *o = out;
+	size_t i = 0;
+	unsigned int lf, hi, k;
+	__m128i v;
+
+	while ((i + 16) <= n && c->state != CANON_END) {
+		if (c->state != CANON_TEXT) {
+			o += canon_scalar(c, (in + i), 1, o);
+			i++;
+			continue;
+		}
+
+		v = _mm_loadu_si128((const __m128i *)(in + i));
+		lf = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		hi = _mm_movemask_epi8(v);
+		_mm_storeu_si128((__m128i *)o, v);
+
+		/* Keep everything before the first \n, the store may run past it */
+		k = (lf ? __builtin_ctz(lf) : 16);
+		if (k > 0) {
+			c->eightbit |= ((hi & ((1u << k) - 1)) != 0);
+			c->cr = (in[(i + k - 1)] == '\r');
+			c->line += k;
+			o += k;
+			i += k;
+		}
+
+		if (lf) {
+			o += canon_scalar(c, (in + i), 1, o);
+			i++;
+		}
+	}
+
+	return ((o - out) + canon_scalar(c, (in + i), (n - i), o));
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * canon_avx2() -- canon_sse2() with 32 byte vectors
+ */
+__attribute__((target("avx2")))
+size_t canon_avx2(struct canon *c, const unsigned char *in, size_t n, char *out) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	char *o = out;
+	size_t i = 0;
+	uint32_t lf, hi, k;
+	__m256i v;
+
+	while ((i + 32) <= n && c->state != CANON_END) {
+		if (c->state != CANON_TEXT) {
+			o += canon_scalar(c, (in + i), 1, o);
+			i++;
+			continue;
+		}
+
+		v = _mm256_loadu_si256((const __m256i *)(in + i));
+		lf = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		hi = (uint32_t)_mm256_movemask_epi8(v);
+		_mm256_storeu_si256((__m256i *)o, v);
+
+		k = (lf ? (uint32_t)__builtin_ctz(lf) : 32);
+		if (k > 0) {
+			c->eightbit |= ((k == 32 ? hi : (hi & ((1u << k) - 1))) != 0);
+			c->cr = (in[(i + k - 1)] == '\r');
+			c->line += k;
+			o += k;
+			i += k;
+		}
+
+		if (lf) {
+			o += canon_scalar(c, (in + i), 1, o);
+			i++;
+		}
+	}
+
+	return ((o - out) + canon_scalar(c, (in + i), (n - i), o));
+}
+#endif
+
+/*
+ * canon() -- Canonicalize with the widest kernel this CPU runs
+ */
+size_t canon(struct canon *c, const unsigned char *in, size_t n, char *out) {
+	static size_t (*kernel)(struct canon *, const unsigned char *, size_t, char *) = NULL;
+
+	if (!kernel) {
+		kernel = canon_scalar;
+#ifdef __SSE2__
+		kernel = canon_sse2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+		if (__builtin_cpu_supports("avx2")) {
+			kernel = canon_avx2;
+		}
+#endif
+	}
+
+	return kernel(c, in, n, out);
+}
+
+/*
+ * canon_finish() -- Flush a dot held back at the end of the input
+ */
+size_t canon_finish(struct canon *c, char *out) {
+	size_t n = 0;
+
+	if (c->state == CANON_DOT || c->state == CANON_DOTCR) {
+		out[n++] = '.';
+		if (c->state == CANON_DOTCR) {
+			out[n++] = '\r';
+		}
+		c->line += n;
+	}
+
+	if ((c->line - (c->state == CANON_DOTCR ? 1 : c->cr)) > BODY_LINE_MAX) {
+		c->longline = 1;
+	}
+	c->state = CANON_END;
+
+	return n;
+}
+
+/*
+ * canon_bench() -- Compare the kernels on a synthetic body, in GB/s
+ */
+int canon_bench(long mb) {
+	struct {
+		char *name;
+		size_t (*kernel)(struct canon *, const unsigned char *, size_t, char *);
+	} k[] = {
+		{ "scalar", canon_scalar },
+#ifdef __SSE2__
+		{ "sse2", canon_sse2 },
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+		{ "avx2", canon_avx2 },
+#endif
+	};
+	size_t n = ((size_t)mb << 20), len, off, ref = 0, i;
+	unsigned char *in;
+	struct canon c;
+	uint64_t start;
+	char *out;
+	int j, run;
+
+	if ((in = (unsigned char *)malloc(n)) == (unsigned char *)NULL
+	 || (out = (char *)malloc((2 * CANON_CHUNK) + CANON_SLACK)) == (char *)NULL) {
+		die("canon_bench() -- malloc() failed");
+	}
+
+	/* Lines of 40 to 100 bytes, mostly bare \n, a few stuffed dots and 8-bit text */
+	srand(1);
+	for (i = 0; i < n;) {
+		len = (40 + (rand() % 60));
+		for (off = 0; off < len && i < n; off++) {
+			in[i++] = ((off == 0 && (rand() % 50) == 0) ? '.' : ('a' + (rand() % 26)));
+		}
+		if (i < n && (rand() % 20) == 0) {
+			in[i - 1] = 0xe9;
+		}
+		if (i < n && (rand() % 4) == 0) {
+			in[i++] = '\r';
+		}
+		if (i < n) {
+			in[i++] = '\n';
+		}
+	}
+
+	for (j = 0; j < (int)(sizeof(k) / sizeof(k[0])); j++) {
+#if defined(__x86_64__) || defined(__i386__)
+		if (k[j].kernel == canon_avx2 && !__builtin_cpu_supports("avx2")) {
+			continue;
+		}
+#endif
+		start = now_us();
+		for (run = 0; run < 3; run++) {
+			memset(&c, 0, sizeof(c));
+			c.flags = (CANON_DOTEND | CANON_UNSTUFF);
+			for (len = 0, off = 0; off < n; off += CANON_CHUNK) {
+				len += k[j].kernel(&c, (in + off), (((n - off) < CANON_CHUNK) ? (n - off) : CANON_CHUNK), out);
+			}
+			len += canon_finish(&c, out);
+		}
+
+		if (!ref) {
+			ref = len;
+		}
+		printf("%-8s %6.2f GB/s%s\n", k[j].name, ((3.0 * n) / ((now_us() - start) * 1000.0)), ((len == ref) ? "" : "  OUTPUT DIFFERS"));
+	}
+
+	free(in);
+	free(out);
+
+	return 0;
+}
+
+/*
+ * Body canonicalization of the message being read. message_read() leaves
+ * it in the middle when the budget runs out, spool_stream() goes on.
+ */
+struct canon message_cn;
+int message_more = 0;
+
+/*
+ * message_read() -- Assemble the MIME message from the saved headers and
+ *	the rest of the stream. Adds From: and Date: when they are missing.
+ *	With held, a message past BUDGET_MSG_COST takes its buffer from the
+ *	memory budget, and every growth after, adding it to *held. A growth
+ *	that does not fit stops the read with message_more set, see
+ *	spool_stream(). Smaller messages never open the budget file.
+ */
+char *message_read(FILE *stream, size_t *len, int64_t *held) {
+	unsigned char chunk[CANON_CHUNK];
+	size_t size = BUF_SZ, grow, n;
+	char *msg, *addr;
+
+	if ((msg = (char *)malloc(size)) == (char *)NULL) {
+		die("message_read() -- malloc() failed");
+	}
+	*len = 0;
+
+#define MSG_APPEND(s, l) do { \
+		while ((*len + (l) + 1) > size) { \
+			size *= 2; \
+			if ((msg = (char *)realloc(msg, size)) == (char *)NULL) { \
+				die("message_read() -- realloc() failed"); \
+			} \
+		} \
+		memcpy(msg + *len, (s), (l)); \
+		*len += (l); \
+	} while (0)
+
+	if (!have_from) {
+		char buf[(BUF_SZ + 1)];
+
+		if (minus_f) {
+			addr = minus_f;
+		} else {
+			struct passwd *pw = getpwuid(getuid());
+
+			snprintf(buf, BUF_SZ, "%s@%s", (pw ? pw->pw_name : "nobody"), (cfg->rewrite ? cfg->rewrite : cfg->domain));
+			if ((addr = strdup(buf)) == (char *)NULL) {
+				die("message_read() -- strdup() failed");
+			}
+		}
+
+		if (minus_F) {
+			n = snprintf(buf, BUF_SZ, "From: \"%s\" <%s>\r\n", minus_F, addr);
+		} else {
+			n = snprintf(buf, BUF_SZ, "From: %s\r\n", addr);
+		}
+		MSG_APPEND(buf, n);
+
+		if (addr != minus_f) {
+			free(addr);
+		}
+	}
+
+	if (!have_date) {
+		char buf[64];
+		time_t now = time(NULL);
+
+		n = strftime(buf, sizeof(buf), "Date: %a, %d %b %Y %H:%M:%S %z\r\n", localtime(&now));
+		MSG_APPEND(buf, n);
+	}
+
+	for (ht = &headers; ht->next; ht = ht->next) {
+		MSG_APPEND(ht->string, strlen(ht->string));
+		MSG_APPEND("\r\n", 2);
+	}
+	MSG_APPEND("\r\n", 2);
+
+	/* Without -i a line with a single dot ends the message, as sendmail
+	   does. Doubled dots are kept, stdin is not SMTP. */
+	memset(&message_cn, 0, sizeof(message_cn));
+	message_cn.flags = (minus_i ? 0 : CANON_DOTEND);
+	message_more = 0;
+
+	while (!message_more && message_cn.state != CANON_END) {
+		/* Room for a full chunk, taken from the budget first */
+		for (grow = size; (grow - *len) < ((2 * sizeof(chunk)) + CANON_SLACK + 1); grow *= 2);
+		if (grow > size) {
+			if (held && *held == 0 && *len >= BUDGET_MSG_COST) {
+				/* Slow the sender down before it holds more */
+				budget_wait();
+				if (!budget_take(grow)) {
+					message_more = 1;
+					break;
+				}
+				*held = grow;
+			} else if (held && *held > 0) {
+				if (!budget_grow(grow - size)) {
+					message_more = 1;
+					break;
+				}
+				*held += (grow - size);
+			}
+			size = grow;
+			if ((msg = (char *)realloc(msg, size)) == (char *)NULL) {
+				die("message_read() -- realloc() failed");
+			}
+		}
+
+		if ((n = fread(chunk, 1, sizeof(chunk), stream)) == 0) {
+			break;
+		}
+		*len += canon(&message_cn, chunk, n, (msg + *len));
+	}
+	msg[*len] = '\0';
+
+	if (!message_more) {
+		*len += canon_finish(&message_cn, (msg + *len));
+		msg[*len] = '\0';
+		body_8bit = message_cn.eightbit;
+		body_longline = message_cn.longline;
+	}
+
+#undef MSG_APPEND
+
+	return msg;
+}
+
+/*
+ * queue_id_new() -- Make a queue ID unique across processes and messages
+ */
+void queue_id_new() {
+	static unsigned int seq = 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	snprintf(queue_id, QID_SZ, "%08lX%05X%04X", (unsigned long)ts.tv_sec,
+		((unsigned int)getpid() & 0xfffff), ((seq++ + (unsigned int)(ts.tv_nsec >> 10)) & 0xffff));
+}
+
+/*
+ * trace_format() -- Render a trace record as one JSON line
+ */
+int trace_format(char *buf, size_t size, struct trace *tr) {
+	char msgid[sizeof(tr->msgid) * 2], *p, *q;
+	int n, i;
+
+	/* The id comes from the API response, keep the JSON intact */
+	for (p = tr->msgid, q = msgid; *p; p++) {
+		if (*p == '"' || *p == '\\') {
+			*q++ = '\\';
+		}
+		*q++ = *p;
+	}
+	*q = '\0';
+
+	n = snprintf(buf, size,
+		"{\"ts\":%lu,\"qid\":\"%s\",\"msgid\":\"%s\",\"size\":%lu,\"bytes_out\":%lu,"
+		"\"rcpts\":%d,\"retries\":%d,\"code\":%ld,\"status\":%d",
+		(unsigned long)tr->ts, tr->qid, msgid, (unsigned long)tr->size,
+		(unsigned long)tr->bytes_out, tr->rcpts, tr->retries, tr->code, tr->status);
+
+	for (i = 0; i < STAGE_MAX && n < (int)size; i++) {
+		n += snprintf(buf + n, (size - n), ",\"%s_us\":%lu", stage_name[i], (unsigned long)tr->t[i]);
+	}
+
+	if (n < (int)size) {
+		n += snprintf(buf + n, (size - n), "}\n");
+	}
+
+	return ((n < (int)size) ? n : 0);
+}
+
+/*
+ * trace_flush() -- Write every queued record with a single append
+ */
+void trace_flush() {
+	char buf[(BUF_SZ * 16)];
+	unsigned long head, tail;
+	size_t len = 0;
+	int n;
+
+	head = atomic_load_explicit(&trace_ring.head, memory_order_acquire);
+	tail = atomic_load_explicit(&trace_ring.tail, memory_order_relaxed);
+
+	for (; tail != head; tail++) {
+		n = trace_format(buf + len, (sizeof(buf) - len), &trace_ring.rec[tail % TRACE_RING]);
+		if (n == 0) {
+			if (len && write(trace_ring.fd, buf, len) < 0) {
+				log_event(LOG_ERR, "cannot write trace file %s", trace_file);
+			}
+			len = 0;
+			n = trace_format(buf, sizeof(buf), &trace_ring.rec[tail % TRACE_RING]);
+		}
+		len += n;
+		atomic_store_explicit(&trace_ring.tail, (tail + 1), memory_order_release);
+	}
+
+	if (len && write(trace_ring.fd, buf, len) < 0) {
+		log_event(LOG_ERR, "cannot write trace file %s", trace_file);
+	}
+}
+
+/*
+ * trace_thread() -- Flusher, wakes on demand or every 200ms
+ */
+void *trace_thread(void *arg) {
+	struct timespec ts;
+	int stop;
+
+	(void)arg;
+
+	do {
+		pthread_mutex_lock(&trace_ring.lock);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 200000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (!trace_ring.stop) {
+			pthread_cond_timedwait(&trace_ring.cond, &trace_ring.lock, &ts);
+		}
+		stop = trace_ring.stop;
+		pthread_mutex_unlock(&trace_ring.lock);
+
+		trace_flush();
+	} while (!stop);
+
+	return NULL;
+}
+
+/*
+ * trace_open() -- Open the trace file and start the flusher
+ */
+void trace_open(char *file) {
+	if ((trace_ring.fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+		log_event(LOG_ERR, "cannot open trace file %s", file);
+		return;
+	}
+
+	if (pthread_create(&trace_ring.thread, NULL, trace_thread, NULL) != 0) {
+		log_event(LOG_ERR, "cannot start trace flusher");
+		close(trace_ring.fd);
+		trace_ring.fd = -1;
+	}
+}
+
+/*
+ * trace_push() -- Queue a record, never blocks
+ */
+void trace_push(struct trace *tr) {
+	unsigned long head, tail;
+
+	if (trace_ring.fd < 0) {
+		return;
+	}
+
+	head = atomic_load_explicit(&trace_ring.head, memory_order_relaxed);
+	tail = atomic_load_explicit(&trace_ring.tail, memory_order_acquire);
+
+	if ((head - tail) >= TRACE_RING) {
+		atomic_fetch_add_explicit(&trace_ring.dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	trace_ring.rec[head % TRACE_RING] = *tr;
+	atomic_store_explicit(&trace_ring.head, (head + 1), memory_order_release);
+
+	/* Only nudge the flusher once the ring starts filling up */
+	if ((head - tail) == (TRACE_RING / 2)) {
+		pthread_cond_signal(&trace_ring.cond);
+	}
+}
+
+/*
+ * trace_close() -- Stop the flusher after it drained the ring
+ */
+void trace_close() {
+	unsigned long dropped;
+
+	if (trace_ring.fd < 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&trace_ring.lock);
+	trace_ring.stop = 1;
+	pthread_cond_signal(&trace_ring.cond);
+	pthread_mutex_unlock(&trace_ring.lock);
+
+	pthread_join(trace_ring.thread, NULL);
+	close(trace_ring.fd);
+	trace_ring.fd = -1;
+
+	if ((dropped = atomic_load(&trace_ring.dropped))) {
+		log_event(LOG_INFO, "%lu trace records dropped", dropped);
+	}
+}
+
+/*
+ * journal_key() -- Hash of a typed journal key
+ */
+uint64_t journal_key(char type, char *key) {
+	char buf[(BUF_SZ + 1)];
+
+	snprintf(buf, sizeof(buf), "%c:%s", type, key);
+
+	return rcpt_hash(buf);
+}
+
+/*
+ * journal_map() -- Map the index of a journal segment
+ *	Writers create it on first use, readers get NULL for a missing index.
+ */
+struct journal_hdr *journal_map(char *segment, int writable) {
+	char path[(BUF_SZ + 1)];
+	struct journal_hdr *hdr;
+	size_t size = (sizeof(struct journal_hdr) + (JOURNAL_SLOTS * sizeof(struct journal_slot)));
+	struct stat st;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s.idx", segment);
+	if ((fd = open(path, (writable ? (O_RDWR | O_CREAT) : O_RDONLY), 0644)) < 0) {
+		return (struct journal_hdr *)NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return (struct journal_hdr *)NULL;
+	}
+
+	/* Sparse, only touched slots take disk space */
+	if (writable && st.st_size == 0) {
+		if (ftruncate(fd, size) < 0) {
+			close(fd);
+			return (struct journal_hdr *)NULL;
+		}
+		st.st_size = size;
+	}
+
+	if ((size_t)st.st_size < sizeof(struct journal_hdr)) {
+		close(fd);
+		return (struct journal_hdr *)NULL;
+	}
+
+	hdr = mmap(NULL, st.st_size, (PROT_READ | (writable ? PROT_WRITE : 0)), MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		return (struct journal_hdr *)NULL;
+	}
+
+	if (writable && hdr->magic[0] == '\0') {
+		hdr->slots = JOURNAL_SLOTS;
+		memcpy(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic));
+	}
+
+	if (memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) != 0
+		|| (sizeof(struct journal_hdr) + (hdr->slots * sizeof(struct journal_slot))) > (size_t)st.st_size) {
+		log_event(LOG_ERR, "journal index %s is corrupt", path);
+		munmap(hdr, st.st_size);
+		return (struct journal_hdr *)NULL;
+	}
+
+	return hdr;
+}
+
+/*
+ * journal_index() -- Add a key to a segment index, 0 if the index is full
+ */
+int journal_index(struct journal_hdr *hdr, char type, char *key, uint64_t off) {
+	struct journal_slot *slot = (struct journal_slot *)(hdr + 1);
+	uint64_t h = journal_key(type, key), mask = (hdr->slots - 1), i, n;
+
+	for (i = (h & mask), n = 0; n < hdr->slots && atomic_load_explicit(&slot[i].off, memory_order_relaxed);
+		i = ((i + 1) & mask), n++);
+	if (n == hdr->slots) {
+		return 0;
+	}
+
+	slot[i].hash = h;
+	atomic_store_explicit(&slot[i].off, (off + 1), memory_order_release);
+	atomic_fetch_add_explicit(&hdr->count, 1, memory_order_relaxed);
+
+	return 1;
+}
+
+/*
+ * journal_segments() -- Rotated segments of the journal, newest first
+ *	Segments are named <journal>.<queue ID>, and queue IDs sort by time.
+ */
+int journal_segments(char ***list) {
+	char *dir_copy, *base_copy, *dir, *base, *p;
+	struct dirent *de;
+	size_t len;
+	int n = 0, i, j;
+	DIR *d;
+
+	*list = (char **)NULL;
+
+	if ((dir_copy = strdup(journal_file)) == (char *)NULL
+		|| (base_copy = strdup(journal_file)) == (char *)NULL) {
+		die("journal_segments() -- strdup() failed");
+	}
+	dir = dirname(dir_copy);
+	base = basename(base_copy);
+	len = strlen(base);
+
+	if ((d = opendir(dir)) != (DIR *)NULL) {
+		while ((de = readdir(d))) {
+			if (strncmp(de->d_name, base, len) != 0 || de->d_name[len] != '.'
+				|| strlen(de->d_name + len + 1) != (QID_SZ - 3)
+				|| strchr(de->d_name + len + 1, '.')) {
+				continue;
+			}
+
+			if ((n % 16) == 0) {
+				if ((*list = realloc(*list, ((n + 16) * sizeof(char *)))) == (char **)NULL) {
+					die("journal_segments() -- realloc() failed");
+				}
+			}
+
+			if ((p = malloc(strlen(dir) + strlen(de->d_name) + 2)) == (char *)NULL) {
+				die("journal_segments() -- malloc() failed");
+			}
+			sprintf(p, "%s/%s", dir, de->d_name);
+			(*list)[n++] = p;
+		}
+		closedir(d);
+	}
+
+	/* Newest first */
+	for (i = 1; i < n; i++) {
+		for (j = i; j > 0 && strcmp((*list)[j - 1], (*list)[j]) < 0; j--) {
+			p = (*list)[j];
+			(*list)[j] = (*list)[j - 1];
+			(*list)[j - 1] = p;
+		}
+	}
+
+	free(dir_copy);
+	free(base_copy);
+
+	return n;
+}
+
+/*
+ * journal_compact() -- Drop segments beyond JOURNAL_KEEP
+ *	Runs after the writer lock is released, removing a segment never
+ *	blocks a delivery and readers that still map it are not affected.
+ */
+void journal_compact() {
+	char path[(BUF_SZ + 1)], **list;
+	int n, i;
+
+	n = journal_segments(&list);
+	for (i = 0; i < n; i++) {
+		if (i >= JOURNAL_KEEP) {
+			snprintf(path, sizeof(path), "%s.idx", list[i]);
+			unlink(path);
+			unlink(list[i]);
+		}
+		free(list[i]);
+	}
+	free(list);
+}
+
+/*
+ * journal_rotate() -- Move the current segment aside, under the writer lock
+ *	The next writer starts a fresh segment.
+ */
+void journal_rotate(char *qid) {
+	char path[(BUF_SZ + 1)], to[(BUF_SZ + 1)];
+
+	snprintf(to, sizeof(to), "%s.%s.idx", journal_file, qid);
+	snprintf(path, sizeof(path), "%s.idx", journal_file);
+	rename(path, to);
+	snprintf(to, sizeof(to), "%s.%s", journal_file, qid);
+	rename(journal_file, to);
+}
+
+/*
+ * journal_write() -- Append the outcome of a delivery and index it
+ *	Line format: time qid status code mailgun-id message-id rcpt,rcpt,...
+ */
+void journal_write(struct trace *tr) {
+	char path[(BUF_SZ + 1)], *line;
+	struct journal_hdr *hdr;
+	int lockfd, fd, rotate, rotated = 0, lost = 0;
+	size_t len, size, keys;
+	off_t off;
+
+	snprintf(path, sizeof(path), "%s.lock", journal_file);
+	if ((lockfd = open(path, (O_RDWR | O_CREAT), 0644)) < 0 || flock(lockfd, LOCK_EX) < 0) {
+		log_event(LOG_ERR, "cannot lock journal %s", journal_file);
+		if (lockfd >= 0) {
+			close(lockfd);
+		}
+		return;
+	}
+
+	keys = (1 + (tr->msgid[0] ? 1 : 0) + ((message_id && strcmp(message_id, tr->msgid) != 0) ? 1 : 0) + rcpt_count);
+
+	for (;;) {
+		hdr = (struct journal_hdr *)NULL;
+		if ((fd = open(journal_file, (O_WRONLY | O_APPEND | O_CREAT), 0644)) < 0
+			|| (off = lseek(fd, 0, SEEK_END)) < 0
+			|| (hdr = journal_map(journal_file, 1)) == (struct journal_hdr *)NULL) {
+			log_event(LOG_ERR, "cannot open journal %s", journal_file);
+			if (fd >= 0) {
+				close(fd);
+			}
+			close(lockfd);
+			return;
+		}
+
+		/* Rotate before the keys of this delivery push the index past
+		   half full, probes stay short and never run out of slots */
+		if (rotated || atomic_load(&hdr->count) == 0
+			|| ((atomic_load(&hdr->count) + keys) * 2) <= hdr->slots) {
+			break;
+		}
+		munmap(hdr, (sizeof(struct journal_hdr) + (JOURNAL_SLOTS * sizeof(struct journal_slot))));
+		close(fd);
+		journal_rotate(tr->qid);
+		rotated = 1;
+	}
+
+	size = (BUF_SZ + (sizeof(tr->msgid) + (message_id ? strlen(message_id) : 1)));
+	for (rt = &rcpt_list; rt->next; rt = rt->next) {
+		size += (strlen(rt->string) + 1);
+	}
+	if ((line = malloc(size)) == (char *)NULL) {
+		die("journal_write() -- malloc() failed");
+	}
+
+	len = snprintf(line, size, "%lu %s %s %ld %s %s ", (unsigned long)(tr->ts / 1000000), tr->qid,
+		((tr->status == 0) ? "sent" : ((tr->status == EX_TEMPFAIL) ? "deferred" : "failed")),
+		tr->code, (tr->msgid[0] ? tr->msgid : "-"), (message_id ? message_id : "-"));
+	for (rt = &rcpt_list; rt->next; rt = rt->next) {
+		len += sprintf(line + len, "%s%s", rt->string, (rt->next->next ? "," : ""));
+	}
+	line[len++] = '\n';
+
+	if (write(fd, line, len) != (ssize_t)len) {
+		log_event(LOG_ERR, "cannot write journal %s", journal_file);
+	} else {
+		lost += !journal_index(hdr, 'q', tr->qid, off);
+		if (tr->msgid[0]) {
+			lost += !journal_index(hdr, 'm', tr->msgid, off);
+		}
+		if (message_id && strcmp(message_id, tr->msgid) != 0) {
+			lost += !journal_index(hdr, 'm', message_id, off);
+		}
+		for (rt = &rcpt_list; rt->next; rt = rt->next) {
+			lost += !journal_index(hdr, 'r', rt->string, off);
+		}
+	}
+	close(fd);
+
+	if (lost) {
+		log_event(LOG_ERR, "%s: journal index full, %d keys not indexed", tr->qid, lost);
+	}
+
+	/* A segment rotated for this delivery already carries its queue ID */
+	rotate = (!rotated && ((size_t)(off + len) >= JOURNAL_SIZE
+		|| (atomic_load(&hdr->count) * 2) >= hdr->slots));
+	munmap(hdr, (sizeof(struct journal_hdr) + (JOURNAL_SLOTS * sizeof(struct journal_slot))));
+	free(line);
+
+	if (rotate) {
+		journal_rotate(tr->qid);
+	}
+
+	flock(lockfd, LOCK_UN);
+	close(lockfd);
+
+	if (rotate || rotated) {
+		journal_compact();
+	}
+}
+
+/*
+ * journal_match() -- Check a journal line really carries the key
+ */
+int journal_match(char *line, char type, char *key) {
+	char *field[7], *p, *save;
+	int n = 0;
+
+	for (p = strtok_r(line, " \n", &save); p && n < 7; p = strtok_r(NULL, " \n", &save)) {
+		field[n++] = p;
+	}
+	if (n < 6) {
+		return 0;
+	}
+
+	switch (type) {
+		case 'q':
+			return (strcmp(field[1], key) == 0);
+		case 'm':
+			return (strcmp(field[4], key) == 0 || strcmp(field[5], key) == 0);
+		case 'r':
+			for (p = strtok_r((n > 6 ? field[6] : ""), ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+				if (strcmp(p, key) == 0) {
+					return 1;
+				}
+			}
+	}
+
+	return 0;
+}
+
+/*
+ * journal_search() -- Print lines of one segment matching a key
+ */
+int journal_search(char *segment, char type, char *key) {
+	struct journal_hdr *hdr;
+	struct journal_slot *slot;
+	uint64_t h, mask, i, n, off;
+	char *line = NULL, *copy;
+	size_t cap = 0;
+	int found = 0;
+	FILE *fp;
+
+	if ((hdr = journal_map(segment, 0)) == (struct journal_hdr *)NULL) {
+		return 0;
+	}
+
+	if ((fp = fopen(segment, "r")) == (FILE *)NULL) {
+		munmap(hdr, (sizeof(struct journal_hdr) + (hdr->slots * sizeof(struct journal_slot))));
+		return 0;
+	}
+
+	slot = (struct journal_slot *)(hdr + 1);
+	mask = (hdr->slots - 1);
+	h = journal_key(type, key);
+
+	for (i = (h & mask), n = 0; n < hdr->slots && (off = atomic_load_explicit(&slot[i].off, memory_order_acquire));
+		i = ((i + 1) & mask), n++) {
+		if (slot[i].hash != h || fseeko(fp, (off - 1), SEEK_SET) < 0
+			|| getline(&line, &cap, fp) <= 0) {
+			continue;
+		}
+
+		if ((copy = strdup(line)) == (char *)NULL) {
+			die("journal_search() -- strdup() failed");
+		}
+		if (journal_match(copy, type, key)) {
+			fputs(line, stdout);
+			found++;
+		}
+		free(copy);
+	}
+
+	free(line);
+	fclose(fp);
+	munmap(hdr, (sizeof(struct journal_hdr) + (hdr->slots * sizeof(struct journal_slot))));
+
+	return found;
+}
+
+/*
+ * journal_lookup() -- Find deliveries by queue ID, Message-ID or recipient
+ */
+int journal_lookup(char *key) {
+	char buf[(BUF_SZ + 1)], *rcpt, **list;
+	int n, i, found = 0;
+
+	cfg = config_read();
+
+	if (!journal_file) {
+		pae("%s: no journal configured\n", prog);
+	}
+
+	/* Message-IDs are journaled with their angle brackets */
+	snprintf(buf, sizeof(buf), ((*key == '<') ? "%s" : "<%s>"), key);
+	rcpt = rcpt_normalize(key);
+
+	n = journal_segments(&list);
+	for (i = -1; i < n; i++) {
+		char *segment = ((i < 0) ? journal_file : list[i]);
+
+		found += journal_search(segment, 'q', key);
+		found += journal_search(segment, 'm', buf);
+		if (strchr(rcpt, '@')) {
+			found += journal_search(segment, 'r', rcpt);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		free(list[i]);
+	}
+	free(list);
+	free(rcpt);
+
+	if (!found) {
+		fprintf(stdout, "%s: not found\n", key);
+	}
+
+	return (found ? 0 : 1);
+}
+
+/*
+ * json_number() -- Value of a numeric member in a flat JSON object
+ */
+long long json_number(char *line, char *key) {
+	char *p;
+
+	if ((p = strstr(line, key)) == (char *)NULL) {
+		return -1;
+	}
+
+	return strtoll(p + strlen(key), NULL, 10);
+}
+
+/*
+ * trace_slowest() -- Print the N slowest deliveries of the trace file,
+ *	optionally limited to the last 'window' seconds
+ */
+int trace_slowest(int n, long window) {
+	char buf[(BUF_SZ * 2)];
+	long long cutoff = 0, total, ts;
+	struct { long long total; char *line; } *top;
+	int count = 0, i, j;
+	FILE *fp;
+
+	cfg = config_read();
+
+	if (!trace_file) {
+		pae("%s: no trace file configured\n", prog);
+	}
+
+	if ((fp = fopen(trace_file, "r")) == (FILE *)NULL) {
+		pae("%s: cannot open %s\n", prog, trace_file);
+	}
+
+	if (window > 0) {
+		cutoff = (((long long)time(NULL) - window) * 1000000);
+	}
+
+	if ((top = calloc(n, sizeof(*top))) == NULL) {
+		die("trace_slowest() -- calloc() failed");
+	}
+
+	/* Keep the top N sorted descending, insertion is fine for small N */
+	while (fgets(buf, sizeof(buf), fp)) {
+		ts = json_number(buf, "\"ts\":");
+		total = json_number(buf, "\"total_us\":");
+		if (ts < cutoff || total < 0) {
+			continue;
+		}
+
+		if (count == n && total <= top[n - 1].total) {
+			continue;
+		}
+
+		if (count < n) {
+			count++;
+		} else {
+			free(top[n - 1].line);
+		}
+
+		for (i = (count - 1); i > 0 && top[i - 1].total < total; i--) {
+			top[i] = top[i - 1];
+		}
+		top[i].total = total;
+		if ((top[i].line = strdup(buf)) == (char *)NULL) {
+			die("trace_slowest() -- strdup() failed");
+		}
+	}
+	fclose(fp);
+
+	for (j = 0; j < count; j++) {
+		fputs(top[j].line, stdout);
+		free(top[j].line);
+	}
+	free(top);
+
+	return 0;
+}
+
+/*
+ * response_write() -- Keep the head of the API response for the log
+ */
+size_t response_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+	char *buf = (char *)userdata;
+	size_t have = strlen(buf), n = (size * nmemb);
+
+	if (have < BUF_SZ) {
+		strncat(buf, ptr, ((n < (BUF_SZ - have)) ? n : (BUF_SZ - have)));
+	}
+
+	return n;
+}
+
+/*
+ * response_msgid() -- Pull the "id" member out of the API response
+ */
+void response_msgid(char *response, char *buf, size_t size) {
+	char *p, *q;
+
+	buf[0] = '\0';
+	if ((p = strstr(response, "\"id\"")) == (char *)NULL) {
+		return;
+	}
+
+	if ((p = strchr(p + 4, '"')) == (char *)NULL) {
+		return;
+	}
+	p++;
+
+	for (q = p; *q && *q != '"'; q++) {
+		if (*q == '\\' && *(q + 1)) {
+			q++;
+		}
+	}
+
+	if ((size_t)(q - p) >= size) {
+		return;
+	}
+	memcpy(buf, p, (q - p));
+	buf[(q - p)] = '\0';
+}
+
+/*
+ * body_mem() -- Upload a message from memory
+ */
+void body_mem(struct body *b, char *msg, size_t len) {
+	memset(b, 0, sizeof(*b));
+	b->msg = msg;
+	b->len = len;
+	b->fd = -1;
+}
+
+/*
+ * body_read() -- Read the message for an upload, see form_read()
+ *	A deflated df file is inflated chunk by chunk as curl asks for more,
+ *	the message is never in memory as a whole.
+ */
+size_t body_read(char *buf, size_t size, size_t nitems, void *arg) {
+	struct body *b = (struct body *)arg;
+	size_t want = (size * nitems), n;
+	ssize_t r;
+	int ret;
+
+	if (want > (b->len - b->pos)) {
+		want = (b->len - b->pos);
+	}
+
+	if (b->msg) {
+		memcpy(buf, (b->msg + b->pos), want);
+		b->pos += want;
+		return want;
+	}
+
+	if (!b->deflated) {
+		if ((r = read(b->fd, buf, want)) < 0) {
+			return CURL_READFUNC_ABORT;
+		}
+		b->pos += r;
+		return r;
+	}
+
+	b->z.next_out = (unsigned char *)buf;
+	b->z.avail_out = want;
+	while (b->z.avail_out > 0) {
+		if (b->z.avail_in == 0) {
+			if ((r = read(b->fd, b->in, CANON_CHUNK)) < 0) {
+				return CURL_READFUNC_ABORT;
+			}
+			if (r == 0) {
+				break;
+			}
+			b->z.next_in = b->in;
+			b->z.avail_in = r;
+		}
+
+		if ((ret = inflate(&b->z, Z_NO_FLUSH)) == Z_STREAM_END) {
+			break;
+		}
+		if (ret != Z_OK) {
+			return CURL_READFUNC_ABORT;
+		}
+	}
+
+	n = (want - b->z.avail_out);
+	b->pos += n;
+
+	return n;
+}
+
+/*
+ * body_seek() -- Rewind the message for another attempt, only the start
+ *	can be sought to
+ */
+int body_seek(void *arg, curl_off_t offset, int origin) {
+	struct body *b = (struct body *)arg;
+
+	if (offset != 0 || origin != SEEK_SET) {
+		return CURL_SEEKFUNC_CANTSEEK;
+	}
+
+	b->pos = 0;
+	if (b->msg) {
+		return CURL_SEEKFUNC_OK;
+	}
+
+	if (lseek(b->fd, b->start, SEEK_SET) < 0) {
+		return CURL_SEEKFUNC_FAIL;
+	}
+	if (b->deflated) {
+		b->z.avail_in = 0;
+		inflateReset(&b->z);
+	}
+
+	return CURL_SEEKFUNC_OK;
+}
+
+/*
+ * body_close() -- Release what reading the message needed
+ */
+void body_close(struct body *b) {
+	if (b->deflated) {
+		inflateEnd(&b->z);
+		free(b->in);
+	}
+	if (b->fd >= 0) {
+		close(b->fd);
+	}
+	b->deflated = 0;
+	b->fd = -1;
+}
+
+/*
+ * form_new() -- Encode the multipart form of a message for its recipients
+ *	The message is not copied, requests read it through b. The caller
+ *	owns the first reference.
+ */
+struct form *form_new(rcpt_t *list, struct body *b) {
+	char boundary[48], *p;
+	struct form *f;
+	size_t size, n;
+	rcpt_t *r;
+
+	if ((f = (struct form *)calloc(1, sizeof(struct form))) == (struct form *)NULL) {
+		die("form_new() -- calloc() failed");
+	}
+	f->refs = 1;
+	f->body = b;
+
+	snprintf(boundary, sizeof(boundary), "------------------------%016llx",
+		(unsigned long long)(rcpt_hash(queue_id) ^ (now_us() << 20) ^ (uintptr_t)f));
+
+	size = (BUF_SZ / 4);
+	for (r = list; r->next; r = r->next) {
+		size += (strlen(r->string) + strlen(boundary) + 56);
+	}
+	if ((f->head = (char *)malloc(size)) == (char *)NULL) {
+		die("form_new() -- malloc() failed");
+	}
+
+	for (p = f->head, r = list; r->next; r = r->next) {
+		p += sprintf(p, "--%s\r\nContent-Disposition: form-data; name=\"to\"\r\n\r\n%s\r\n",
+			boundary, r->string);
+	}
+	p += sprintf(p, "--%s\r\nContent-Disposition: form-data; name=\"message\"; filename=\"message.mime\"\r\n\r\n",
+		boundary);
+	f->head_len = (p - f->head);
+
+	f->tail_len = snprintf(f->tail, sizeof(f->tail), "\r\n--%s--\r\n", boundary);
+	f->size = (f->head_len + b->len + f->tail_len);
+
+	n = snprintf(NULL, 0, "Content-Type: multipart/form-data; boundary=%s", boundary);
+	if ((p = (char *)malloc(n + 1)) == (char *)NULL) {
+		die("form_new() -- malloc() failed");
+	}
+	sprintf(p, "Content-Type: multipart/form-data; boundary=%s", boundary);
+	f->headers = curl_slist_append(NULL, p);
+	free(p);
+
+	return f;
+}
+
+/*
+ * form_hold() -- Take another reference on a form
+ */
+struct form *form_hold(struct form *f) {
+	atomic_fetch_add(&f->refs, 1);
+
+	return f;
+}
+
+/*
+ * form_release() -- Drop a reference, the last one frees the form
+ */
+void form_release(struct form *f) {
+	if (f && atomic_fetch_sub(&f->refs, 1) == 1) {
+		curl_slist_free_all(f->headers);
+		free(f->head);
+		free(f);
+	}
+}
+
+/*
+ * form_read() -- Read callback of an upload, gathers the encoded fields,
+ *	the message and the closing boundary without copying them together
+ */
+size_t form_read(char *buf, size_t size, size_t nitems, void *arg) {
+	struct request *rq = (struct request *)arg;
+	struct form *f = rq->form;
+	size_t want = (size * nitems), n;
+	curl_off_t off, end = (f->head_len + f->body->len);
+
+	if (rq->pos < (curl_off_t)f->head_len) {
+		n = (f->head_len - rq->pos);
+		n = ((n < want) ? n : want);
+		memcpy(buf, (f->head + rq->pos), n);
+	} else if (rq->pos < end) {
+		if ((n = body_read(buf, 1, want, f->body)) == CURL_READFUNC_ABORT) {
+			return n;
+		}
+	} else {
+		off = (rq->pos - end);
+		n = ((curl_off_t)f->tail_len - off);
+		n = ((n < want) ? n : want);
+		memcpy(buf, (f->tail + off), n);
+	}
+	rq->pos += n;
+
+	return n;
+}
+
+/*
+ * form_seek() -- Seek callback of an upload, curl rewinds it to resend
+ */
+int form_seek(void *arg, curl_off_t offset, int origin) {
+	struct request *rq = (struct request *)arg;
+
+	if (offset != 0 || origin != SEEK_SET) {
+		return CURL_SEEKFUNC_CANTSEEK;
+	}
+	rq->pos = 0;
+
+	return body_seek(rq->form->body, 0, SEEK_SET);
+}
+
+/*
+ * request_start() -- Prepare one upload of a message to one endpoint
+ *	The handle comes from the endpoint pool, request_finish() returns it.
+ */
+void request_start(struct request *rq, struct route *r, struct endpoint *ep, struct form *f) {
+	rq->route = r;
+	rq->ep = ep;
+
+	/* get a curl handle */
+	if ((rq->curl = route_handle(ep)) == (CURL *)NULL) {
+		die("request_start() -- curl_easy_init() failed");
+	}
+
+	rq->form = form_hold(f);
+	form_seek(rq, 0, SEEK_SET);
+
+	rq->response[0] = '\0';
+
+	curl_easy_setopt(rq->curl, CURLOPT_URL, ep->url);
+	curl_easy_setopt(rq->curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(rq->curl, CURLOPT_POSTFIELDSIZE_LARGE, f->size);
+	curl_easy_setopt(rq->curl, CURLOPT_HTTPHEADER, f->headers);
+	curl_easy_setopt(rq->curl, CURLOPT_READFUNCTION, form_read);
+	curl_easy_setopt(rq->curl, CURLOPT_READDATA, rq);
+	curl_easy_setopt(rq->curl, CURLOPT_SEEKFUNCTION, form_seek);
+	curl_easy_setopt(rq->curl, CURLOPT_SEEKDATA, rq);
+	curl_easy_setopt(rq->curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
+	curl_easy_setopt(rq->curl, CURLOPT_USERPWD, r->userpwd);
+	curl_easy_setopt(rq->curl, CURLOPT_CONNECTTIMEOUT_MS, (long)CONNECT_TIMEOUT);
+	curl_easy_setopt(rq->curl, CURLOPT_TIMEOUT, cfg->timeout);
+	curl_easy_setopt(rq->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(rq->curl, CURLOPT_WRITEFUNCTION, response_write);
+	curl_easy_setopt(rq->curl, CURLOPT_WRITEDATA, rq->response);
+}
+
+/*
+ * request_finish() -- Account for a finished upload and pool its handle
+ *	Stage timings, sizes and the response code go into the trace record.
+ */
+CURLcode request_finish(struct request *rq, CURLcode res, struct trace *tr) {
+	curl_off_t dns = 0, conn = 0, tls = 0, start = 0, total = 0, up = 0;
+	long code = 0;
+
+	curl_easy_getinfo(rq->curl, CURLINFO_RESPONSE_CODE, &code);
+	curl_easy_getinfo(rq->curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+	curl_easy_getinfo(rq->curl, CURLINFO_CONNECT_TIME_T, &conn);
+	curl_easy_getinfo(rq->curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+	curl_easy_getinfo(rq->curl, CURLINFO_STARTTRANSFER_TIME_T, &start);
+	curl_easy_getinfo(rq->curl, CURLINFO_TOTAL_TIME_T, &total);
+	curl_easy_getinfo(rq->curl, CURLINFO_SIZE_UPLOAD_T, &up);
+
+	/* curl reports offsets from the start, turn them into stage times */
+	metrics_observe(STAGE_DNS, dns);
+	if (conn) {
+		metrics_observe(STAGE_CONNECT, (conn - dns));
+	}
+	if (tls) {
+		metrics_observe(STAGE_TLS, (tls - conn));
+	}
+	if (start) {
+		metrics_observe(STAGE_FIRST_BYTE, (start - (tls ? tls : conn)));
+	}
+	metrics_observe(STAGE_TOTAL, total);
+	METRIC_ADD(bytes_out, up);
+	METRIC_ADD(http[((code >= 100 && code < 600) ? (code / 100) : 0)], 1);
+
+	tr->t[STAGE_DNS] = dns;
+	tr->t[STAGE_CONNECT] = (conn ? (conn - dns) : 0);
+	tr->t[STAGE_TLS] = (tls ? (tls - conn) : 0);
+	tr->t[STAGE_FIRST_BYTE] = (start ? (start - (tls ? tls : conn)) : 0);
+	tr->t[STAGE_TOTAL] = total;
+	tr->bytes_out = up;
+	tr->code = code;
+
+	/* Errors of the endpoint itself count against it, refusals do not */
+	endpoint_update(rq->ep, (res != CURLE_OK || code >= 500), total);
+
+	/* always cleanup */
+	route_release(rq->ep, rq->curl);
+	form_release(rq->form);
+	rq->form = NULL;
+	rq->curl = NULL;
+
+	return res;
+}
+
+/*
+ * request_failover() -- Whether a finished upload should go to the next
+ *	endpoint, network errors and 5xx do.
+ */
+int request_failover(struct request *rq, CURLcode res, struct trace *tr) {
+	if (res == CURLE_OK && tr->code < 500) {
+		return 0;
+	}
+
+	if (res != CURLE_OK) {
+		log_event(LOG_INFO, "api call to %s failed: %s", rq->ep->url, curl_easy_strerror(res));
+	} else {
+		log_event(LOG_INFO, "api call to %s failed: %ld %s", rq->ep->url, tr->code, rq->response);
+	}
+
+	return 1;
+}
+
+/*
+ * deliver_status() -- Turn the last upload of a message into an exit code
+ *	Returns 0 when accepted, EX_TEMPFAIL for errors worth a retry and
+ *	EX_UNAVAILABLE when the API refused the message. The Mailgun message
+ *	ID goes into the trace record.
+ */
+int deliver_status(struct trace *tr, CURLcode res, char *response) {
+	int status;
+
+	/* Check for errors */
+	if (res != CURLE_OK) {
+		snprintf(tr->error, sizeof(tr->error), "%s", curl_easy_strerror(res));
+		status = EX_TEMPFAIL;
+	} else if (tr->code >= 200 && tr->code < 300) {
+		status = 0;
+	} else if (tr->code == 429 || tr->code >= 500) {
+		log_event(LOG_INFO, "api call deferred: %ld %s", tr->code, response);
+		snprintf(tr->error, sizeof(tr->error), "HTTP %ld", tr->code);
+		status = EX_TEMPFAIL;
+	} else {
+		log_event(LOG_ERR, "api call refused: %ld %s", tr->code, response);
+		snprintf(tr->error, sizeof(tr->error), "HTTP %ld", tr->code);
+		status = EX_UNAVAILABLE;
+	}
+
+	METRIC_ADD(msg[(status == 0) ? MSG_SENT
+		: ((status == EX_TEMPFAIL) ? MSG_DEFERRED : MSG_FAILED)], 1);
+
+	tr->status = status;
+	response_msgid(response, tr->msgid, sizeof(tr->msgid));
+
+	return status;
+}
+
+/*
+ * deliver() -- Upload the message to the messages.mime API
+ *	Tries the fastest healthy endpoint of the route and fails over to the
+ *	next one on network errors and 5xx. See deliver_status() for the
+ *	result.
+ */
+int deliver(struct route *r, struct body *b, struct trace *tr) {
+	struct request rq;
+	struct endpoint *ep;
+	struct form *f;
+	CURLcode res = CURLE_OK;
+	int tried = 0;
+
+	route_throttle(r);
+
+	/* Every endpoint tried gets the same encoding */
+	f = form_new(&rcpt_list, b);
+
+	rq.response[0] = '\0';
+	while ((ep = endpoint_select(r, tried))) {
+		tried |= (1 << (ep - r->ep));
+
+		request_start(&rq, r, ep, f);
+
+		/* Perform the request, res will get the return code */
+		res = request_finish(&rq, curl_easy_perform(rq.curl), tr);
+		if (!request_failover(&rq, res, tr)) {
+			break;
+		}
+	}
+	form_release(f);
+
+	return deliver_status(tr, res, rq.response);
+}
+
+/*
+ * setup() -- Read the config and prepare everything a delivery needs
+ */
+void setup() {
+	struct config *c = config_read();
+
+	if (!c->api || !c->domain) {
+		die("api or domain not set");
+	}
+
+	if (!queue_dir) {
+		queue_dir = QUEUE_DIR;
+	}
+
+	if (stats_file) {
+		metrics_open(stats_file);
+	}
+
+	/* A detaching daemon starts the flusher after daemon(), threads do
+	   not survive the fork */
+	if (trace_file && minus_bd != 1) {
+		trace_open(trace_file);
+	}
+
+	if (health_file) {
+		health_open(health_file);
+	}
+
+	route_setup(c);
+	config_publish(c);
+
+	cfg = config_acquire();
+}
+
+/*
+ * config_reload() -- Re-read the config file and publish it, on SIGHUP
+ *	A config that fails to validate is dropped and the old one stays.
+ */
+void config_reload() {
+	struct config *c = config_read();
+
+	if (!c->api || !c->domain) {
+		log_event(LOG_ERR, "reload: api or domain not set, keeping the old config");
+		config_release(c);
+		return;
+	}
+
+	route_setup(c);
+	config_publish(c);
+
+	/* Remap the alias file too, newaliases may have rebuilt it */
+	if (alias_db.map) {
+		munmap(alias_db.map, alias_db.size);
+		alias_db.map = NULL;
+	}
+	alias_db.tried = 0;
+
+	log_event(LOG_INFO, "config %s reloaded", config_file);
+}
+
+/*
+ * teardown() -- Flush traces and close every connection
+ */
+void teardown() {
+	budget_close();
+	trace_close();
+	config_release(cfg);
+	config_release(atomic_exchange(&config_live, NULL));
+
+	if (net_ready) {
+		curl_global_cleanup();
+		net_ready = 0;
+	}
+}
+
+/*
+ * rcpt_reset() -- Empty the RCPT list and the recipient set
+ */
+void rcpt_reset() {
+	rcpt_t *next;
+
+	/* Every listed address is in the set, which also owns the local names */
+	for (rt = rcpt_list.next; rt; rt = next) {
+		next = rt->next;
+		free(rt);
+	}
+	rcpt_list.string = NULL;
+	rcpt_list.next = NULL;
+
+	for (unsigned long i = 0; i < rcpt_set.size; i++) {
+		free(rcpt_set.slot[i]);
+	}
+	free(rcpt_set.slot);
+	memset(&rcpt_set, 0, sizeof(rcpt_set));
+	rcpt_count = 0;
+
+	rt = &rcpt_list;
+}
+
+/*
+ * rcpt_take() -- Move the recipients out of the globals into s
+ */
+void rcpt_take(struct rcpt_state *s) {
+	s->list = rcpt_list;
+	s->set = rcpt_set;
+	s->count = rcpt_count;
+
+	memset(&rcpt_list, 0, sizeof(rcpt_list));
+	memset(&rcpt_set, 0, sizeof(rcpt_set));
+	rcpt_count = 0;
+
+	rt = &rcpt_list;
+}
+
+/*
+ * rcpt_put() -- Make the recipients in s the current ones again
+ */
+void rcpt_put(struct rcpt_state *s) {
+	rcpt_reset();
+
+	rcpt_list = s->list;
+	rcpt_set = s->set;
+	rcpt_count = s->count;
+
+	memset(s, 0, sizeof(*s));
+}
+
+/*
+ * header_reset() -- Empty the header list for the next message
+ */
+void header_reset() {
+	headers_t *next;
+
+	free(headers.string);
+	for (ht = headers.next; ht; ht = next) {
+		next = ht->next;
+		free(ht->string);
+		free(ht);
+	}
+	memset(&headers, 0, sizeof(headers));
+
+	ht = &headers;
+	have_from = 0;
+	have_to = 0;
+	have_date = 0;
+
+	free(message_id);
+	message_id = NULL;
+	free(from);
+	from = NULL;
+}
+
+/*
+ * route_lookup() -- Route by the match it was configured with
+ */
+struct route *route_lookup(struct config *c, int kind, char *match) {
+	struct route *r;
+
+	for (r = c->routes; r && match; r = r->next) {
+		if (r->kind == kind && strcmp(r->match, match) == 0) {
+			return r;
+		}
+	}
+
+	return &c->default_route;
+}
+
+/*
+ * spool_path() -- Name of a spool file of a message
+ */
+void spool_path(char *buf, char *type, char *qid) {
+	snprintf(buf, (BUF_SZ + 1), "%s/%s%s", queue_dir, type, qid);
+}
+
+/*
+ * qindex_valid() -- Whether a mapped index has this layout and its size
+ */
+int qindex_valid(struct qindex_hdr *hdr, size_t size) {
+	return (memcmp(hdr->magic, QINDEX_MAGIC, sizeof(hdr->magic)) == 0
+		&& (sizeof(struct qindex_hdr) + (hdr->slots * sizeof(struct qindex_slot))) == size);
+}
+
+/*
+ * qindex_open() -- Open and lock the queue index, mapped into *hdr
+ *	Writers create it, and start it over when it has another layout or
+ *	size, qindex_rebuild() fills it again from the spool. Readers get -1
+ *	for a missing or such an index.
+ */
+int qindex_open(int writable, struct qindex_hdr **hdr, size_t *size) {
+	char path[(BUF_SZ + 1)];
+	struct stat st;
+	int fd;
+
+	spool_path(path, "", "index");
+	if ((fd = open(path, (writable ? (O_RDWR | O_CREAT) : O_RDONLY), 0600)) < 0) {
+		if (!writable || errno != ENOENT || mkdir(queue_dir, 0700) < 0
+			|| (fd = open(path, (O_RDWR | O_CREAT), 0600)) < 0) {
+			return -1;
+		}
+	}
+
+	if (flock(fd, (writable ? LOCK_EX : LOCK_SH)) < 0 || fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	/* Sparse, only touched slots take disk space */
+	if (writable && st.st_size == 0) {
+		st.st_size = (sizeof(struct qindex_hdr) + (QINDEX_SLOTS * sizeof(struct qindex_slot)));
+		if (ftruncate(fd, st.st_size) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	if ((size_t)st.st_size < sizeof(struct qindex_hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	*size = st.st_size;
+	*hdr = mmap(NULL, *size, (PROT_READ | (writable ? PROT_WRITE : 0)), MAP_SHARED, fd, 0);
+	if (*hdr == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	if (writable && (*hdr)->magic[0] != '\0' && !qindex_valid(*hdr, *size)) {
+		log_event(LOG_INFO, "queue index %s has another layout, rebuilding it", path);
+		munmap(*hdr, *size);
+
+		*size = (sizeof(struct qindex_hdr) + (QINDEX_SLOTS * sizeof(struct qindex_slot)));
+		if (ftruncate(fd, 0) < 0 || ftruncate(fd, *size) < 0
+			|| (*hdr = mmap(NULL, *size, (PROT_READ | PROT_WRITE), MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (writable && (*hdr)->magic[0] == '\0') {
+		(*hdr)->slots = QINDEX_SLOTS;
+		memcpy((*hdr)->magic, QINDEX_MAGIC, sizeof((*hdr)->magic));
+	}
+
+	if (!qindex_valid(*hdr, *size)) {
+		munmap(*hdr, *size);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * qindex_close() -- Unmap and unlock the queue index
+ */
+void qindex_close(int fd, struct qindex_hdr *hdr, size_t size) {
+	munmap(hdr, size);
+	close(fd);
+}
+
+/*
+ * qindex_key() -- Hash of a queue ID, never one of the free/deleted marks
+ */
+uint64_t qindex_key(char *qid) {
+	uint64_t h = rcpt_hash(qid);
+
+	return ((h < 2) ? (h + 2) : h);
+}
+
+/*
+ * qindex_find() -- Slot of a queue ID, or with insert the slot to store it
+ */
+struct qindex_slot *qindex_find(struct qindex_hdr *hdr, char *qid, int insert) {
+	struct qindex_slot *slot = (struct qindex_slot *)(hdr + 1), *free_slot = NULL;
+	uint64_t h = qindex_key(qid), mask = (hdr->slots - 1), i;
+
+	for (i = (h & mask); slot[i].hash; i = ((i + 1) & mask)) {
+		if (slot[i].hash == h && strcmp(slot[i].qid, qid) == 0) {
+			return &slot[i];
+		}
+		if (slot[i].hash == 1 && !free_slot) {
+			free_slot = &slot[i];
+		}
+	}
+
+	if (!insert) {
+		return (struct qindex_slot *)NULL;
+	}
+
+	return (free_slot ? free_slot : &slot[i]);
+}
+
+/*
+ * qindex_grow() -- Rehash without the deleted slots, into a table twice as
+ *	large unless the live entries fill less than half of it. On failure
+ *	the index stays mapped and unchanged.
+ */
+int qindex_grow(int fd, struct qindex_hdr **hdr, size_t *size) {
+	struct qindex_slot *slot = (struct qindex_slot *)(*hdr + 1), *live, *s;
+	struct qindex_hdr *map;
+	uint64_t slots = ((*hdr)->slots * (((*hdr)->live * 2) < (*hdr)->slots ? 1 : 2)), n = 0, i, complete;
+	size_t new_size = (sizeof(struct qindex_hdr) + (slots * sizeof(struct qindex_slot)));
+
+	if ((live = (struct qindex_slot *)malloc(((*hdr)->live + 1) * sizeof(struct qindex_slot))) == (struct qindex_slot *)NULL) {
+		die("qindex_grow() -- malloc() failed");
+	}
+	for (i = 0; i < (*hdr)->slots; i++) {
+		if (slot[i].hash > 1) {
+			live[n++] = slot[i];
+		}
+	}
+
+	/* The table only ever grows, the old mapping stays valid until the
+	   new one is there */
+	if ((new_size > *size && ftruncate(fd, new_size) < 0)
+		|| (map = mmap(NULL, new_size, (PROT_READ | PROT_WRITE), MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		free(live);
+		return 0;
+	}
+	munmap(*hdr, *size);
+	*hdr = map;
+	*size = new_size;
+
+	/* A crash from here on leaves an index that gets rebuilt */
+	complete = (*hdr)->complete;
+	(*hdr)->complete = 0;
+	memset((*hdr + 1), 0, (slots * sizeof(struct qindex_slot)));
+	(*hdr)->slots = slots;
+	(*hdr)->used = (*hdr)->live = n;
+
+	for (i = 0; i < n; i++) {
+		s = qindex_find(*hdr, live[i].qid, 1);
+		*s = live[i];
+	}
+	free(live);
+	(*hdr)->complete = complete;
+
+	return 1;
+}
+
+/*
+ * qindex_bloom() -- Filter bits of a recipient address or @domain
+ */
+uint64_t qindex_bloom(char *key) {
+	uint64_t h = rcpt_hash(key);
+
+	return ((1ULL << (h & 63)) | (1ULL << ((h >> 6) & 63)));
+}
+
+/*
+ * message_sender() -- Address in the From: header of an assembled message
+ */
+void message_sender(char *msg, size_t len, char *buf, size_t size) {
+	char *p = msg, *end = (msg + len), *eol, *line, *addr;
+
+	buf[0] = '\0';
+
+	for (; p < end && *p != '\r' && *p != '\n'; p = (eol + 1)) {
+		if ((eol = memchr(p, '\n', (end - p))) == (char *)NULL) {
+			eol = end;
+		}
+
+		if ((eol - p) > 5 && strncasecmp(p, "From:", 5) == 0) {
+			if ((line = strndup(p, (eol - p))) == (char *)NULL) {
+				die("message_sender() -- strndup() failed");
+			}
+			strip_post_ws(line);
+			addr = from_strip(line);
+			snprintf(buf, size, "%s", addr);
+			free(addr);
+			free(line);
+			return;
+		}
+	}
+}
+
+/*
+ * qindex_store() -- Add or refresh the entry of the current message in the
+ *	locked index. Returns 0 when the index could not grow.
+ */
+int qindex_store(int fd, struct qindex_hdr **hdr, size_t *size, struct qmsg *q, char *msg, size_t len) {
+	struct qindex_slot *s, keep;
+	char *at;
+
+	if ((((*hdr)->used + 1) * 4) > ((*hdr)->slots * 3) && !qindex_grow(fd, hdr, size)) {
+		log_event(LOG_ERR, "%s: cannot grow the queue index", q->qid);
+		return 0;
+	}
+
+	s = qindex_find(*hdr, q->qid, 1);
+	if (s->hash == 0) {
+		(*hdr)->used++;
+	}
+	if (s->hash < 2) {
+		(*hdr)->live++;
+		(*hdr)->generation++;
+	}
+
+	/* Without the message the sender and size stay what they were */
+	memset(&keep, 0, sizeof(keep));
+	if (msg == (char *)NULL && s->hash > 1) {
+		memcpy(&keep, s, sizeof(keep));
+	}
+
+	memset(s, 0, sizeof(*s));
+	snprintf(s->qid, sizeof(s->qid), "%s", q->qid);
+	s->retries = q->retries;
+	s->uid = q->uid;
+	s->lane = q->lane;
+	s->size = (q->size ? q->size : (msg ? len : keep.size));
+	s->created = q->created;
+	s->next = q->next;
+	/* The listing only shows the start of the error */
+	snprintf(s->error, sizeof(s->error), "%.*s", (int)(sizeof(s->error) - 1), q->error);
+	if (msg) {
+		message_sender(msg, len, s->sender, sizeof(s->sender));
+	} else {
+		memcpy(s->sender, keep.sender, sizeof(s->sender));
+	}
+
+	for (rt = &rcpt_list; rt->next; rt = rt->next) {
+		s->rcpts++;
+		s->bloom |= qindex_bloom(rt->string);
+		if ((at = strrchr(rt->string, '@'))) {
+			s->bloom |= qindex_bloom(at);
+		}
+	}
+	s->hash = qindex_key(q->qid);
+
+	return 1;
+}
+
+/*
+ * qindex_put() -- Add or refresh the index entry of the current message
+ */
+void qindex_put(struct qmsg *q, char *msg, size_t len) {
+	struct qindex_hdr *hdr;
+	size_t size;
+	int fd;
+
+	if ((fd = qindex_open(1, &hdr, &size)) < 0) {
+		log_event(LOG_ERR, "%s: cannot update the queue index", q->qid);
+		return;
+	}
+
+	qindex_store(fd, &hdr, &size, q, msg, len);
+	qindex_close(fd, hdr, size);
+}
+
+/*
+ * qindex_generation() -- Generation of the queue index, 0 without one
+ */
+uint64_t qindex_generation() {
+	struct qindex_hdr *hdr;
+	uint64_t gen;
+	size_t size;
+	int fd;
+
+	if ((fd = qindex_open(0, &hdr, &size)) < 0) {
+		return 0;
+	}
+	gen = hdr->generation;
+	qindex_close(fd, hdr, size);
+
+	return gen;
+}
+
+/*
+ * qindex_del() -- Drop a message from the queue index
+ */
+void qindex_del(char *qid) {
+	struct qindex_hdr *hdr;
+	struct qindex_slot *s;
+	size_t size;
+	int fd;
+
+	if ((fd = qindex_open(1, &hdr, &size)) < 0) {
+		return;
+	}
+
+	if ((s = qindex_find(hdr, qid, 0))) {
+		s->hash = 1;
+		hdr->live--;
+	}
+
+	qindex_close(fd, hdr, size);
+}
+
+/*
+ * sink_open() -- Start writing a df file, deflated with zip, see
+ *	SPOOL_ZMAGIC. The header is completed by sink_close().
+ */
+int sink_open(struct spool_sink *k, int fd, int zip) {
+	memset(&k->z, 0, sizeof(k->z));
+	k->fd = fd;
+	k->len = 0;
+	k->out = 0;
+	k->zip = (zip && deflateInit2(&k->z, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+
+	if (k->zip) {
+		memset(k->buf, 0, SPOOL_ZHDR);
+		if (write(fd, k->buf, SPOOL_ZHDR) != (ssize_t)SPOOL_ZHDR) {
+			deflateEnd(&k->z);
+			k->zip = 0;
+			return 0;
+		}
+		k->out = SPOOL_ZHDR;
+	}
+
+	return 1;
+}
+
+/*
+ * sink_deflate() -- Feed the deflate stream and write what comes out
+ */
+int sink_deflate(struct spool_sink *k, int flush) {
+	size_t n;
+	int ret;
+
+	do {
+		k->z.next_out = k->buf;
+		k->z.avail_out = sizeof(k->buf);
+		if ((ret = deflate(&k->z, flush)) == Z_STREAM_ERROR) {
+			return 0;
+		}
+
+		n = (sizeof(k->buf) - k->z.avail_out);
+		if (write(k->fd, k->buf, n) != (ssize_t)n) {
+			return 0;
+		}
+		k->out += n;
+	} while (k->z.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+	return 1;
+}
+
+/*
+ * sink_put() -- Append message data to a df file
+ */
+int sink_put(struct spool_sink *k, void *data, size_t len) {
+	size_t n;
+
+	k->len += len;
+	if (!k->zip) {
+		k->out += len;
+		return (write(k->fd, data, len) == (ssize_t)len);
+	}
+
+	k->z.next_in = (unsigned char *)data;
+	for (; len > 0; len -= n) {
+		n = ((len < (1U << 30)) ? len : (1U << 30));
+		k->z.avail_in = n;
+		if (!sink_deflate(k, Z_NO_FLUSH)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * sink_close() -- Finish a df file, ok says whether writing it went well
+ */
+int sink_close(struct spool_sink *k, int ok) {
+	unsigned char hdr[SPOOL_ZHDR];
+	uint64_t size = k->len;
+
+	if (!k->zip) {
+		return ok;
+	}
+
+	ok = (ok && sink_deflate(k, Z_FINISH));
+	deflateEnd(&k->z);
+
+	memcpy(hdr, SPOOL_ZMAGIC, 4);
+	memcpy((hdr + 4), &size, sizeof(size));
+
+	return (ok && pwrite(k->fd, hdr, SPOOL_ZHDR, 0) == (ssize_t)SPOOL_ZHDR);
+}
+
+/*
+ * spool_create() -- Open the temporary file a spool file is written to
+ */
+int spool_create(char *tmp, char *qid) {
+	int fd;
+
+	snprintf(tmp, (BUF_SZ + 1), "%s/tf%s", queue_dir, qid);
+
+	if ((fd = open(tmp, (O_WRONLY | O_CREAT | O_TRUNC), 0600)) < 0) {
+		if (errno != ENOENT || mkdir(queue_dir, 0700) < 0
+			|| (fd = open(tmp, (O_WRONLY | O_CREAT | O_TRUNC), 0600)) < 0) {
+			log_event(LOG_ERR, "cannot create %s", tmp);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+/*
+ * spool_install() -- Sync a written temporary file and rename it to path
+ */
+int spool_install(int fd, char *tmp, char *path, int ok) {
+	if (!ok || fsync(fd) < 0) {
+		log_event(LOG_ERR, "cannot write %s", tmp);
+		close(fd);
+		unlink(tmp);
+		return 0;
+	}
+	close(fd);
+
+	if (rename(tmp, path) < 0) {
+		log_event(LOG_ERR, "cannot rename %s", tmp);
+		unlink(tmp);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * spool_commit() -- Write a spool file next to its target and rename
+ *	With zip the data is deflated, data that does not get smaller is
+ *	written plain instead.
+ */
+int spool_commit(char *type, char *qid, char *data, size_t len, int zip) {
+	char path[(BUF_SZ + 1)], tmp[(BUF_SZ + 1)];
+	struct spool_sink k;
+	int fd, ok;
+
+	spool_path(path, type, qid);
+	if ((fd = spool_create(tmp, qid)) < 0) {
+		return 0;
+	}
+
+	if (zip) {
+		ok = sink_open(&k, fd, 1);
+		ok = sink_close(&k, (ok && sink_put(&k, data, len)));
+
+		/* Already base64 or compressed */
+		if (ok && k.out >= len) {
+			ok = (ftruncate(fd, 0) == 0 && pwrite(fd, data, len, 0) == (ssize_t)len);
+		}
+	} else {
+		ok = (write(fd, data, len) == (ssize_t)len);
+	}
+
+	return spool_install(fd, tmp, path, ok);
+}
+
+/*
+ * spool_control() -- (Re)write the control file of a message
+ *	The control file is written last, a message without one is not queued.
+ */
+int spool_control(struct qmsg *q) {
+	char *buf;
+	size_t size = (BUF_SZ * 2), len;
+	int ok;
+
+	for (rt = &rcpt_list; rt->next; rt = rt->next) {
+		size += (strlen(rt->string) + 3);
+	}
+	if (q->msgid) {
+		size += strlen(q->msgid);
+	}
+	if ((buf = (char *)malloc(size)) == (char *)NULL) {
+		die("spool_control() -- malloc() failed");
+	}
+
+	len = snprintf(buf, size, "V1\nT %ld\nN %d\nA %ld\nM %d %s\nI %s\nE %s\nP %d\nU %d\n",
+		q->created, q->retries, q->next, q->route_kind, (q->route ? q->route : "-"),
+		(q->msgid ? q->msgid : "-"), (q->error[0] ? q->error : "-"), q->lane, q->uid);
+	for (rt = &rcpt_list; rt->next; rt = rt->next) {
+		len += sprintf(buf + len, "R %s\n", rt->string);
+	}
+
+	ok = spool_commit("qf", q->qid, buf, len, 0);
+	free(buf);
+
+	return ok;
+}
+
+/*
+ * spool_queue() -- Index and queue a message whose df file is written
+ */
+int spool_queue(struct qmsg *q, char *msg, size_t len) {
+	/* Indexed before the control file exists, a runner may deliver and
+	   drop the message the moment it does */
+	qindex_put(q, msg, len);
+
+	if (!spool_control(q)) {
+		char path[(BUF_SZ + 1)];
+
+		qindex_del(q->qid);
+		spool_path(path, "df", q->qid);
+		unlink(path);
+		return 0;
+	}
+
+	METRIC_ADD(msg[MSG_SPOOLED], 1);
+	METRIC_ADD(queue_depth, 1);
+
+	return 1;
+}
+
+/*
+ * spool_write() -- Queue the current message for a later attempt
+ */
+int spool_write(struct qmsg *q, char *msg, size_t len) {
+	if (!spool_commit("df", q->qid, msg, len, (cfg->compress > 0 && len >= (size_t)cfg->compress))) {
+		return 0;
+	}
+
+	return spool_queue(q, msg, len);
+}
+
+/*
+ * spool_stream() -- Queue the current message while it is still being read
+ *	msg holds the start of it as message_read() left it, the rest of the
+ *	body goes from the stream through the canonicalizer straight into the
+ *	df file, so the message is never in memory as a whole.
+ */
+int spool_stream(struct qmsg *q, char *msg, size_t len, FILE *stream) {
+	unsigned char chunk[CANON_CHUNK];
+	char path[(BUF_SZ + 1)], tmp[(BUF_SZ + 1)], out[((2 * CANON_CHUNK) + CANON_SLACK)];
+	struct spool_sink k;
+	size_t n;
+	int fd, ok;
+
+	spool_path(path, "df", q->qid);
+	if ((fd = spool_create(tmp, q->qid)) < 0) {
+		return 0;
+	}
+
+	ok = (sink_open(&k, fd, (cfg->compress > 0)) && sink_put(&k, msg, len));
+	while (ok && message_cn.state != CANON_END && (n = fread(chunk, 1, sizeof(chunk), stream)) > 0) {
+		ok = sink_put(&k, out, canon(&message_cn, chunk, n, out));
+	}
+	ok = (ok && sink_put(&k, out, canon_finish(&message_cn, out)));
+	ok = sink_close(&k, ok);
+
+	message_more = 0;
+	body_8bit = message_cn.eightbit;
+	body_longline = message_cn.longline;
+
+	if (!spool_install(fd, tmp, path, ok)) {
+		return 0;
+	}
+	q->size = k.len;
+
+	return spool_queue(q, msg, len);
+}
+
+/*
+ * spool_remove() -- Drop a message from the queue
+ */
+void spool_remove(char *qid) {
+	char path[(BUF_SZ + 1)];
+
+	spool_path(path, "qf", qid);
+	unlink(path);
+	spool_path(path, "df", qid);
+	unlink(path);
+	qindex_del(qid);
+
+	METRIC_ADD(queue_depth, -1);
+}
+
+/*
+ * queue_wake_open() -- Open the wakeup FIFO of a running daemon
+ *	Opening a FIFO for writing without blocking fails unless someone
+ *	reads it, so this also tells whether the daemon is up. Returns -1
+ *	when it is not.
+ */
+int queue_wake_open() {
+	char path[(BUF_SZ + 1)];
+
+	spool_path(path, "", "wake");
+
+	return open(path, (O_WRONLY | O_NONBLOCK));
+}
+
+/*
+ * queue_wake() -- Have the daemon run the queue now, for mail that is due
+ *	right away. fd is from queue_wake_open(), -1 opens it here.
+ */
+void queue_wake(int fd) {
+	if (fd < 0 && (fd = queue_wake_open()) < 0) {
+		return;
+	}
+
+	/* A full FIFO already has a wakeup pending */
+	if (write(fd, "q", 1) < 0 && errno != EAGAIN) {
+		log_event(LOG_INFO, "cannot wake the queue runner");
+	}
+	close(fd);
+}
+
+/*
+ * spool_load() -- Read the control file of a message into q and the RCPT list
+ */
+int spool_load(FILE *fp, struct qmsg *q) {
+	char *line = NULL, *p;
+	size_t cap = 0;
+	ssize_t n;
+
+	rcpt_reset();
+
+	while ((n = getline(&line, &cap, fp)) > 0) {
+		if (line[n - 1] == '\n') {
+			line[--n] = '\0';
+		}
+		if (n < 2) {
+			continue;
+		}
+		p = (line + 2);
+
+		switch (line[0]) {
+			case 'T':
+				q->created = atol(p);
+				break;
+			case 'N':
+				q->retries = atoi(p);
+				break;
+			case 'A':
+				q->next = atol(p);
+				break;
+			case 'M':
+				q->route_kind = (int)strtol(p, &p, 10);
+				p = strip_pre_ws(p);
+				q->route = ((strcmp(p, "-") == 0) ? NULL : strdup(p));
+				break;
+			case 'I':
+				q->msgid = ((strcmp(p, "-") == 0) ? NULL : strdup(p));
+				break;
+			case 'E':
+				snprintf(q->error, sizeof(q->error), "%s", ((strcmp(p, "-") == 0) ? "" : p));
+				break;
+			case 'P':
+				q->lane = atoi(p);
+				if (q->lane < 0 || q->lane >= LANE_MAX) {
+					q->lane = LANE_NORMAL;
+				}
+				break;
+			case 'U':
+				q->uid = atoi(p);
+				break;
+			case 'R':
+				if ((p = strdup(p)) == (char *)NULL) {
+					die("spool_load() -- strdup() failed");
+				}
+				rcpt_add(p, ALIAS_DEPTH);
+				break;
+		}
+	}
+	free(line);
+
+	return (rcpt_list.next != (rcpt_t *)NULL);
+}
+
+/*
+ * body_spool() -- Upload the message of a queued entry from its df file
+ *	Returns 0 when it is missing or unreadable.
+ */
+int body_spool(struct body *b, char *qid) {
+	char path[(BUF_SZ + 1)];
+	unsigned char hdr[SPOOL_ZHDR];
+	struct stat st;
+	uint64_t size;
+
+	memset(b, 0, sizeof(*b));
+	spool_path(path, "df", qid);
+	if ((b->fd = open(path, O_RDONLY)) < 0) {
+		return 0;
+	}
+
+	if (fstat(b->fd, &st) < 0) {
+		body_close(b);
+		return 0;
+	}
+	b->len = st.st_size;
+
+	if (read(b->fd, hdr, SPOOL_ZHDR) == (ssize_t)SPOOL_ZHDR && memcmp(hdr, SPOOL_ZMAGIC, 4) == 0) {
+		memcpy(&size, (hdr + 4), sizeof(size));
+		b->len = size;
+		b->start = SPOOL_ZHDR;
+
+		if ((b->in = (unsigned char *)malloc(CANON_CHUNK)) == (unsigned char *)NULL) {
+			die("body_spool() -- malloc() failed");
+		}
+		if (inflateInit2(&b->z, -15) != Z_OK) {
+			free(b->in);
+			body_close(b);
+			return 0;
+		}
+		b->deflated = 1;
+	}
+
+	if (lseek(b->fd, b->start, SEEK_SET) < 0) {
+		body_close(b);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * deliver_log() -- Write the trace record and journal line of a delivery
+ *	of the current message.
+ */
+void deliver_log(struct trace *tr) {
+	tr->ts = now_wall_us();
+	trace_push(tr);
+
+	if (journal_file) {
+		journal_write(tr);
+	}
+}
+
+/*
+ * deliver_record() -- Deliver and write the trace record and journal line
+ */
+int deliver_record(struct route *route, struct body *b, struct trace *tr) {
+	int status;
+
+	status = deliver(route, b, tr);
+	deliver_log(tr);
+
+	return status;
+}
+
+/*
+ * queue_backoff() -- Seconds until the next attempt of a deferred message
+ */
+long queue_backoff(int retries) {
+	long wait = QUEUE_INTERVAL;
+
+	while (--retries > 0 && wait < RETRY_MAX) {
+		wait *= 2;
+	}
+
+	return ((wait < RETRY_MAX) ? wait : RETRY_MAX);
+}
+
+/*
+ * queue_attempt() -- Try one queued message, the qf file is locked
+ */
+void queue_attempt(FILE *fp, char *qid) {
+	struct config *outer = cfg;
+	struct qmsg q;
+	struct trace tr;
+	struct body body;
+	long now = time(NULL);
+	int status;
+
+	/* The message finishes on this config, even if a reload happens */
+	cfg = config_acquire();
+
+	memset(&q, 0, sizeof(q));
+	snprintf(q.qid, QID_SZ, "%s", qid);
+
+	/* A control file only appears by rename, once complete. Without a
+	   recipient it never goes anywhere, a run would read it forever. */
+	if (!spool_load(fp, &q)) {
+		log_event(LOG_ERR, "%s: control file has no recipients, removed", qid);
+		spool_remove(qid);
+		goto done;
+	}
+
+	if (q.next > now) {
+		goto done;
+	}
+
+	if (!body_spool(&body, qid)) {
+		log_event(LOG_ERR, "%s: message data missing, removed", qid);
+		spool_remove(qid);
+		goto done;
+	}
+
+	/* Streamed from disk, only the buffers count. Left for a later run
+	   when the budget is used up. */
+	if (!budget_take(BUDGET_MSG_COST)) {
+		body_close(&body);
+		goto done;
+	}
+
+	metrics_observe(STAGE_QUEUE, ((uint64_t)(now - q.created) * 1000000));
+
+	memset(&tr, 0, sizeof(tr));
+	strcpy(tr.qid, qid);
+	tr.size = body.len;
+	tr.rcpts = rcpt_count;
+	tr.retries = q.retries;
+
+	free(message_id);
+	message_id = q.msgid;
+	q.msgid = NULL;
+
+	status = deliver_record(route_lookup(cfg, q.route_kind, q.route), &body, &tr);
+	body_close(&body);
+	budget_put(BUDGET_MSG_COST);
+
+	if (status == 0) {
+		spool_remove(qid);
+	} else if (status == EX_TEMPFAIL && (now - q.created) < QUEUE_LIFETIME) {
+		q.retries++;
+		q.next = (now + queue_backoff(q.retries));
+		snprintf(q.error, sizeof(q.error), "%s", tr.error);
+		q.msgid = message_id;
+		if (spool_control(&q)) {
+			qindex_put(&q, NULL, 0);
+		}
+		q.msgid = NULL;
+	} else {
+		log_event(LOG_ERR, "%s: given up after %d attempts: %s", qid, (q.retries + 1), tr.error);
+		if (status == EX_TEMPFAIL) {
+			METRIC_ADD(msg[MSG_FAILED], 1);
+		}
+		spool_remove(qid);
+	}
+
+done:
+	free(q.route);
+	free(q.msgid);
+
+	config_release(cfg);
+	cfg = outer;
+}
+
+/*
+ * qindex_rebuild() -- Index the spooled messages the index does not know
+ *	of yet. Runs once, when the index was lost or the queue predates it.
+ */
+void qindex_rebuild() {
+	char path[(BUF_SZ + 1)], head[(BUF_SZ * 8)];
+	struct qindex_hdr *hdr;
+	struct dirent *de;
+	struct body body;
+	struct qmsg q;
+	size_t size, len, n;
+	FILE *fp;
+	DIR *d;
+	int fd;
+
+	if ((fd = qindex_open(1, &hdr, &size)) < 0) {
+		return;
+	}
+
+	if (hdr->complete || (d = opendir(queue_dir)) == (DIR *)NULL) {
+		qindex_close(fd, hdr, size);
+		return;
+	}
+
+	while ((de = readdir(d))) {
+		if (strncmp(de->d_name, "qf", 2) != 0) {
+			continue;
+		}
+
+		spool_path(path, "qf", (de->d_name + 2));
+		if ((fp = fopen(path, "r")) == (FILE *)NULL) {
+			continue;
+		}
+
+		memset(&q, 0, sizeof(q));
+		snprintf(q.qid, QID_SZ, "%s", (de->d_name + 2));
+		spool_load(fp, &q);
+		fclose(fp);
+
+		/* The headers are enough for the sender */
+		n = 0;
+		len = 0;
+		if (body_spool(&body, q.qid)) {
+			len = body.len;
+			if ((n = body_read(head, 1, sizeof(head), &body)) > sizeof(head)) {
+				n = 0;
+			}
+			body_close(&body);
+		}
+
+		if (!qindex_store(fd, &hdr, &size, &q, head, n)) {
+			free(q.route);
+			free(q.msgid);
+			closedir(d);
+			qindex_close(fd, hdr, size);
+			return;
+		}
+		qindex_find(hdr, q.qid, 0)->size = len;
+
+		free(q.route);
+		free(q.msgid);
+	}
+	closedir(d);
+	rcpt_reset();
+
+	hdr->complete = 1;
+	qindex_close(fd, hdr, size);
+}
+
+/*
+ * qentry_cmp() -- Order due messages by lane, owner and age
+ */
+int qentry_cmp(const void *a, const void *b) {
+	const struct qentry *x = a, *y = b;
+
+	if (x->lane != y->lane) {
+		return (x->lane - y->lane);
+	}
+	if (x->owner != y->owner) {
+		return ((x->owner < y->owner) ? -1 : 1);
+	}
+
+	if (x->created != y->created) {
+		return ((x->created < y->created) ? -1 : 1);
+	}
+
+	/* Queue IDs sort by time within the second */
+	return strcmp(x->qid, y->qid);
+}
+
+/*
+ * queue_collect() -- Due messages of the queue, in qentry_cmp() order
+ *	The spool directory says what is queued, the queue index when it is
+ *	due and who it belongs to. A message the index misses is due now and
+ *	costs what its df file holds. *gen is the index generation scanned.
+ */
+size_t queue_collect(struct qentry **list, int64_t *depth, uint64_t *gen) {
+	char path[(BUF_SZ + 1)];
+	struct qindex_hdr *hdr = (struct qindex_hdr *)NULL;
+	struct qindex_slot *s;
+	struct config *c = config_acquire();
+	struct qentry *e;
+	struct dirent *de;
+	struct stat st;
+	size_t n = 0, cap = 1024, size = 0;
+	long now = time(NULL);
+	int fd;
+	DIR *d;
+
+	*depth = 0;
+	*gen = 0;
+	*list = (struct qentry *)NULL;
+
+	if ((d = opendir(queue_dir)) == (DIR *)NULL) {
+		config_release(c);
+		return 0;
+	}
+
+	if ((*list = (struct qentry *)malloc(cap * sizeof(struct qentry))) == (struct qentry *)NULL) {
+		die("queue_collect() -- malloc() failed");
+	}
+
+	if ((fd = qindex_open(0, &hdr, &size)) >= 0) {
+		*gen = hdr->generation;
+	}
+
+	while ((de = readdir(d))) {
+		if (strncmp(de->d_name, "qf", 2) != 0) {
+			continue;
+		}
+		(*depth)++;
+
+		s = ((fd >= 0) ? qindex_find(hdr, (de->d_name + 2), 0) : (struct qindex_slot *)NULL);
+		if (s && s->next > now) {
+			continue;
+		}
+
+		if (n == cap) {
+			cap *= 2;
+			if ((*list = (struct qentry *)realloc(*list, (cap * sizeof(struct qentry)))) == (struct qentry *)NULL) {
+				die("queue_collect() -- realloc() failed");
+			}
+		}
+
+		e = &(*list)[n++];
+		memset(e, 0, sizeof(*e));
+		snprintf(e->qid, QID_SZ, "%s", (de->d_name + 2));
+		if (s) {
+			e->lane = s->lane;
+			e->owner = (c->fair_sender ? rcpt_hash(s->sender) : s->uid);
+			e->size = (s->size + DRR_MSG_COST);
+			e->created = s->created;
+		} else {
+			spool_path(path, "df", e->qid);
+			e->size = (DRR_MSG_COST + ((stat(path, &st) == 0) ? st.st_size : 0));
+		}
+	}
+	closedir(d);
+
+	if (fd >= 0) {
+		qindex_close(fd, hdr, size);
+	}
+	config_release(c);
+
+	qsort(*list, n, sizeof(struct qentry), qentry_cmp);
+
+	return n;
+}
+
+/*
+ * queue_try() -- Attempt a queued message unless another runner has it
+ */
+void queue_try(char *qid) {
+	char path[(BUF_SZ + 1)];
+	FILE *fp;
+
+	spool_path(path, "qf", qid);
+	if ((fp = fopen(path, "r")) == (FILE *)NULL) {
+		return;
+	}
+
+	if (daemon_reload) {
+		daemon_reload = 0;
+		config_reload();
+	}
+
+	if (flock(fileno(fp), (LOCK_EX | LOCK_NB)) == 0) {
+		queue_attempt(fp, qid);
+	}
+	fclose(fp);
+}
+
+/*
+ * drr_next() -- Next message of a lane by deficit round robin
+ *	Each owner in turn gets DRR_QUANTUM bytes of credit and sends while
+ *	its oldest message fits, so every owner gets the same share of the
+ *	lane however many messages it has queued.
+ */
+struct qentry *drr_next(struct qentry *list, struct drr_lane *l) {
+	struct drr_flow *f;
+
+	while (l->active > 0) {
+		f = &l->flow[l->cur];
+
+		if (f->start < f->end && list[f->start].size <= f->deficit) {
+			f->deficit -= list[f->start].size;
+			if (++f->start == f->end) {
+				f->deficit = 0;
+				l->active--;
+			}
+			return &list[(f->start - 1)];
+		}
+
+		/* Turn over, the next owner with mail gets its quantum */
+		l->cur = ((l->cur + 1) % l->nflow);
+		if (l->flow[l->cur].start < l->flow[l->cur].end) {
+			l->flow[l->cur].deficit += DRR_QUANTUM;
+		}
+	}
+
+	return (struct qentry *)NULL;
+}
+
+/*
+ * queue_run() -- One pass over the queue
+ *	Lanes are served by weighted round robin, owners within a lane by
+ *	deficit round robin. Every QUEUE_SLICE the queue is rescanned if mail
+ *	was queued meanwhile, so urgent mail does not wait behind a bulk
+ *	backlog. Every message is locked while it is tried, a second runner
+ *	skips it.
+ */
+void queue_run() {
+	struct drr_lane lane[LANE_MAX], *l;
+	uint64_t last[LANE_MAX], start, gen;
+	struct qentry *list, *e;
+	size_t n, i;
+	int64_t depth = 0;
+	int k, w, left, served[LANE_MAX];
+
+	qindex_rebuild();
+
+	memset(served, 0, sizeof(served));
+
+	do {
+		if ((n = queue_collect(&list, &depth, &gen)) == 0) {
+			free(list);
+			break;
+		}
+
+		/* One flow per owner and lane, the list is sorted that way */
+		memset(lane, 0, sizeof(lane));
+		for (i = 0; i < n; i++) {
+			l = &lane[list[i].lane];
+
+			if (i == 0 || list[i].lane != list[(i - 1)].lane || list[i].owner != list[(i - 1)].owner) {
+				if ((l->flow = (struct drr_flow *)realloc(l->flow, ((l->nflow + 1) * sizeof(struct drr_flow)))) == (struct drr_flow *)NULL) {
+					die("queue_run() -- realloc() failed");
+				}
+				l->flow[l->nflow].start = i;
+				l->flow[l->nflow].deficit = 0;
+				l->nflow++;
+				l->active++;
+			}
+			l->flow[(l->nflow - 1)].end = (i + 1);
+		}
+
+		/* After a rescan, pick up with the owner after the one served last */
+		for (k = 0; k < LANE_MAX; k++) {
+			l = &lane[k];
+			if (l->nflow == 0) {
+				continue;
+			}
+
+			if (served[k]) {
+				for (; l->cur < l->nflow && list[l->flow[l->cur].start].owner <= last[k]; l->cur++);
+				if (l->cur == l->nflow) {
+					l->cur = 0;
+				}
+			}
+			l->flow[l->cur].deficit = DRR_QUANTUM;
+		}
+
+		/* Nothing new in the index, go on with this list */
+		do {
+			start = now_us();
+			left = 1;
+			while (left && !daemon_stop && (now_us() - start) < QUEUE_SLICE) {
+				left = 0;
+				for (i = 0; i < LANE_MAX; i++) {
+					k = lane_order[i];
+					for (w = 0; w < lane_weight[k] && (e = drr_next(list, &lane[k])); w++) {
+						last[k] = e->owner;
+						served[k] = 1;
+						queue_try(e->qid);
+					}
+					left |= (lane[k].active > 0);
+				}
+			}
+		} while (left && !daemon_stop && qindex_generation() == gen);
+
+		for (k = 0; k < LANE_MAX; k++) {
+			free(lane[k].flow);
+		}
+		free(list);
+	} while (left && !daemon_stop);
+
+	/* Resync, other processes change the queue as well */
+	if (!daemon_stop) {
+		atomic_store(&metrics->queue_depth, depth);
+	}
+}
+
+/*
+ * stats_thread() -- Answer every connection to the stats socket with the
+ *	counters. A client that sends an HTTP request gets an HTTP response,
+ *	one that sends nothing within 100ms the bare text.
+ */
+void *stats_thread(void *arg) {
+	struct timeval tv = { 1, 0 };
+	struct pollfd pfd;
+	char req[1024];
+	ssize_t n;
+	FILE *fp;
+	int c;
+
+	(void)arg;
+
+	for (;;) {
+		if ((c = accept(stats_server.fd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+
+		/* A slow reader must not keep the next one waiting */
+		setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		n = 0;
+		pfd.fd = c;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0 && (n = read(c, req, (sizeof(req) - 1))) < 0) {
+			n = 0;
+		}
+		req[n] = '\0';
+
+		if ((fp = fdopen(c, "w")) == (FILE *)NULL) {
+			close(c);
+			continue;
+		}
+		if (strncmp(req, "GET ", 4) == 0) {
+			fprintf(fp, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+		}
+		metrics_write(fp);
+		fclose(fp);
+	}
+
+	return NULL;
+}
+
+/*
+ * stats_serve() -- Listen on the stats socket of the queue directory
+ */
+void stats_serve() {
+	char path[(BUF_SZ + 1)];
+	int fd;
+
+	spool_path(path, "", "stats.sock");
+	if (strlen(path) >= sizeof(stats_server.addr.sun_path)) {
+		log_event(LOG_ERR, "stats socket path %s is too long", path);
+		return;
+	}
+
+	memset(&stats_server.addr, 0, sizeof(stats_server.addr));
+	stats_server.addr.sun_family = AF_UNIX;
+	strcpy(stats_server.addr.sun_path, path);
+
+	/* A socket left by a daemon that did not stop cleanly */
+	unlink(path);
+	if ((fd = socket(AF_UNIX, (SOCK_STREAM | SOCK_CLOEXEC), 0)) < 0
+		|| bind(fd, (struct sockaddr *)&stats_server.addr, sizeof(stats_server.addr)) < 0
+		|| chmod(path, 0660) < 0
+		|| listen(fd, 16) < 0) {
+		log_event(LOG_ERR, "cannot listen on %s", path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+
+	stats_server.fd = fd;
+	if (pthread_create(&stats_server.thread, NULL, stats_thread, NULL) != 0) {
+		log_event(LOG_ERR, "cannot start the stats server");
+		close(fd);
+		unlink(path);
+		stats_server.fd = -1;
+	}
+}
+
+/*
+ * stats_stop() -- Stop the stats server and remove its socket
+ */
+void stats_stop() {
+	if (stats_server.fd < 0) {
+		return;
+	}
+
+	/* Wakes the thread out of accept() */
+	shutdown(stats_server.fd, SHUT_RDWR);
+	pthread_join(stats_server.thread, NULL);
+	close(stats_server.fd);
+	unlink(stats_server.addr.sun_path);
+	stats_server.fd = -1;
+}
+
+/*
+ * daemon_signal() -- Ask the daemon loop to stop, or to reload on SIGHUP
+ */
+void daemon_signal(int sig) {
+	if (sig == SIGHUP) {
+		daemon_reload = 1;
+	} else {
+		daemon_stop = 1;
+	}
+}
+
+/*
+ * path_absolute() -- Absolute form of a path given relative to the working
+ *	directory, which daemon() leaves. A path that does not exist yet is
+ *	joined to the working directory as it is.
+ */
+char *path_absolute(char *path) {
+	char *abs, *cwd;
+
+	if (!path || *path == '/') {
+		return path;
+	}
+
+	if ((abs = realpath(path, (char *)NULL)) != (char *)NULL) {
+		return abs;
+	}
+
+	if ((cwd = getcwd((char *)NULL, 0)) == (char *)NULL) {
+		die("path_absolute() -- getcwd() failed");
+	}
+	if ((abs = (char *)malloc(strlen(cwd) + strlen(path) + 2)) == (char *)NULL) {
+		die("path_absolute() -- malloc() failed");
+	}
+	sprintf(abs, "%s/%s", cwd, path);
+	free(cwd);
+
+	return abs;
+}
+
+/*
+ * smailgun_daemon() -- Run the queue every interval, keep connections warm
+ *	-bd detaches, -bD stays in the foreground.
+ */
+int smailgun_daemon() {
+	char path[(BUF_SZ + 1)], buf[64];
+	struct sigaction sa;
+	struct pollfd pfd;
+	long next_run = 0, now;
+	int keep = -1;
+
+	setup();
+
+	/* Pinned per message and per maintenance pass from here on */
+	config_release(cfg);
+	cfg = NULL;
+
+	/* Reloads and lazily opened files must still find them from / */
+	config_file = path_absolute(config_file);
+	queue_dir = path_absolute(queue_dir);
+	journal_file = path_absolute(journal_file);
+	aliases_file = path_absolute(aliases_file);
+	trace_file = path_absolute(trace_file);
+
+	if (minus_bd == 1) {
+		if (daemon(0, 0) < 0) {
+			die("cannot detach");
+		}
+		if (trace_file) {
+			trace_open(trace_file);
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	/* Submissions spool and write to the FIFO, see queue_wake(). The
+	   daemon holds a writer itself so the FIFO never reads as closed. */
+	spool_path(path, "", "wake");
+	pfd.events = POLLIN;
+	mkdir(queue_dir, 0700);
+	if ((mkfifo(path, 0600) < 0 && errno != EEXIST)
+		|| (pfd.fd = open(path, (O_RDONLY | O_NONBLOCK))) < 0
+		|| (keep = open(path, (O_WRONLY | O_NONBLOCK))) < 0) {
+		log_event(LOG_ERR, "cannot listen on %s, submissions wait for the next queue run", path);
+		pfd.fd = -1;
+	}
+	stats_serve();
+
+	log_event(LOG_INFO, "daemon started, queue %s every %lds", queue_dir,
+		(queue_interval ? queue_interval : QUEUE_INTERVAL));
+
+	while (!daemon_stop) {
+		if (daemon_reload) {
+			daemon_reload = 0;
+			config_reload();
+		}
+
+		cfg = config_acquire();
+		route_maintain(cfg);
+		config_release(cfg);
+		cfg = NULL;
+
+		if ((now = time(NULL)) >= next_run) {
+			queue_run();
+			next_run = (now + (queue_interval ? queue_interval : QUEUE_INTERVAL));
+		}
+
+		/* Sleep a second, or until a submission arrives */
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 1000) > 0 && (pfd.revents & POLLIN)) {
+			while (read(pfd.fd, buf, sizeof(buf)) > 0);
+			queue_run();
+		}
+	}
+
+	if (pfd.fd >= 0) {
+		unlink(path);
+		close(pfd.fd);
+	}
+	if (keep >= 0) {
+		close(keep);
+	}
+	stats_stop();
+
+	log_event(LOG_INFO, "daemon stopped");
+	teardown();
+
+	return 0;
+}
+
+/*
+ * qindex_rcpt() -- Whether a queued message has a recipient, or with
+ *	@domain any recipient in the domain. Reads the control file.
+ */
+int qindex_rcpt(char *qid, char *filter) {
+	char path[(BUF_SZ + 1)];
+	struct qmsg q;
+	char *at;
+	FILE *fp;
+	int found = 0;
+
+	spool_path(path, "qf", qid);
+	if ((fp = fopen(path, "r")) == (FILE *)NULL) {
+		return 0;
+	}
+
+	memset(&q, 0, sizeof(q));
+	spool_load(fp, &q);
+	fclose(fp);
+
+	for (rt = &rcpt_list; rt->next && !found; rt = rt->next) {
+		if (*filter == '@') {
+			found = ((at = strrchr(rt->string, '@')) && strcmp(at, filter) == 0);
+		} else {
+			found = (strcmp(rt->string, filter) == 0);
+		}
+	}
+
+	free(q.route);
+	free(q.msgid);
+	rcpt_reset();
+
+	return found;
+}
+
+/*
+ * mailq() -- List the queue from the queue index, mailq or -bp
+ *	-qS<text> keeps messages whose sender contains text, -qR<address> or
+ *	-qR@<domain> those with that recipient. Counts by state end the list.
+ */
+int mailq() {
+	char created[32], next[32], *rcpt = (char *)NULL, *p;
+	struct qindex_slot *slot, *list, s;
+	struct qindex_hdr *hdr;
+	uint64_t bits = 0, i, n = 0;
+	long now = time(NULL);
+	int fd, total = 0, fresh = 0, deferred = 0, due = 0;
+	size_t size;
+
+	cfg = config_read();
+	if (!queue_dir) {
+		queue_dir = QUEUE_DIR;
+	}
+
+	qindex_rebuild();
+
+	if ((fd = qindex_open(0, &hdr, &size)) < 0) {
+		printf("%s is empty\n", queue_dir);
+		return 0;
+	}
+
+	/* Copy the live entries out, the listing may go to a slow pager and
+	   must not hold up the writers of the index meanwhile */
+	if ((list = (struct qindex_slot *)malloc((hdr->live + 1) * sizeof(struct qindex_slot))) == (struct qindex_slot *)NULL) {
+		die("mailq() -- malloc() failed");
+	}
+	slot = (struct qindex_slot *)(hdr + 1);
+	for (i = 0; i < hdr->slots && n <= hdr->live; i++) {
+		if (slot[i].hash >= 2) {
+			list[n++] = slot[i];
+		}
+	}
+	qindex_close(fd, hdr, size);
+
+	/* Recipients are stored normalized, match them that way */
+	if (qfilter_rcpt) {
+		rcpt = rcpt_normalize(qfilter_rcpt);
+		if (*rcpt == '@') {
+			for (p = rcpt; *p; p++) {
+				*p = tolower((unsigned char)*p);
+			}
+		}
+		bits = qindex_bloom(rcpt);
+	}
+
+	printf("%-17s %8s %-15s %5s %5s %-15s %s\n", "Queue ID", "Size", "Queued", "Rcpts", "Tries", "Next try", "Sender");
+
+	for (i = 0; i < n; i++) {
+		s = list[i];
+
+		if (qfilter_sender && !strcasestr(s.sender, qfilter_sender)) {
+			continue;
+		}
+
+		/* The filter bits rule most messages out without opening them */
+		if (rcpt && ((s.bloom & bits) != bits || !qindex_rcpt(s.qid, rcpt))) {
+			continue;
+		}
+
+		strftime(created, sizeof(created), "%b %d %H:%M:%S", localtime((time_t *)&s.created));
+		strftime(next, sizeof(next), "%b %d %H:%M:%S", localtime((time_t *)&s.next));
+		printf("%-17s %8llu %-15s %5u %5u %-15s %s\n", s.qid, (unsigned long long)s.size, created,
+			s.rcpts, s.retries, ((s.next <= now) ? "now" : next), (s.sender[0] ? s.sender : "-"));
+		if (s.error[0]) {
+			printf("%17s (%s)\n", "", s.error);
+		}
+
+		total++;
+		if (s.retries == 0) {
+			fresh++;
+		} else {
+			deferred++;
+		}
+		if (s.next <= now) {
+			due++;
+		}
+	}
+
+	printf("Total requests: %d (%d new, %d deferred, %d due now)\n", total, fresh, deferred, due);
+
+	free(rcpt);
+	free(list);
+
+	return 0;
+}
+
+/*
+ * smailgun_queue() -- Run the queue once, -q
+ */
+int smailgun_queue() {
+	setup();
+	queue_run();
+	teardown();
+
+	return 0;
+}
+
+/*
+ * batch_mbox() -- Next message of an mbox stream, without its From_ line
+ *	mboxrd quoting is undone, ">From " in a body becomes "From " again.
+ */
+char *batch_mbox(struct batch_src *s, size_t *len) {
+	size_t size = BUF_SZ;
+	ssize_t n;
+	char *buf;
+	int q;
+
+	if ((buf = (char *)malloc(size)) == (char *)NULL) {
+		die("batch_mbox() -- malloc() failed");
+	}
+	*len = 0;
+
+	while ((n = getline(&s->line, &s->cap, s->mbox)) > 0) {
+		if (strncmp(s->line, "From ", 5) == 0) {
+			if (*len > 0) {
+				break;
+			}
+			continue;
+		}
+
+		for (q = 0; s->line[q] == '>'; q++);
+		if (q > 0 && strncmp((s->line + q), "From ", 5) == 0) {
+			memmove(s->line, (s->line + 1), n--);
+		}
+
+		while ((*len + n + 1) > size) {
+			size *= 2;
+			if ((buf = (char *)realloc(buf, size)) == (char *)NULL) {
+				die("batch_mbox() -- realloc() failed");
+			}
+		}
+		memcpy((buf + *len), s->line, n);
+		*len += n;
+	}
+
+	if (*len == 0) {
+		free(buf);
+		return (char *)NULL;
+	}
+
+	/* The empty line before the next From_ line is not part of the message */
+	if (*len >= 2 && buf[(*len - 1)] == '\n' && buf[(*len - 2)] == '\n') {
+		(*len)--;
+	}
+	buf[*len] = '\0';
+
+	return buf;
+}
+
+/*
+ * batch_maildir() -- Next message of a Maildir, new/ first and then cur/
+ */
+char *batch_maildir(struct batch_src *s, size_t *len, char *source) {
+	char *sub[] = { "new", "cur" };
+	char path[(BUF_SZ + 1)];
+	struct dirent *de;
+	struct stat st;
+	char *buf;
+	int fd;
+
+	while (s->sub < 2) {
+		if (!s->dir) {
+			snprintf(path, sizeof(path), "%s/%s", s->maildir, sub[s->sub]);
+			if ((s->dir = opendir(path)) == (DIR *)NULL) {
+				s->sub++;
+				continue;
+			}
+		}
+
+		if ((de = readdir(s->dir)) == (struct dirent *)NULL) {
+			closedir(s->dir);
+			s->dir = NULL;
+			s->sub++;
+			continue;
+		}
+
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+
+		snprintf(source, (BUF_SZ + 1), "%s/%s", sub[s->sub], de->d_name);
+		snprintf(path, sizeof(path), "%s/%s", s->maildir, source);
+		if ((fd = open(path, O_RDONLY)) < 0) {
+			log_event(LOG_ERR, "batch: cannot open %s", path);
+			continue;
+		}
+
+		if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+			close(fd);
+			continue;
+		}
+
+		if ((buf = (char *)malloc(st.st_size + 1)) == (char *)NULL) {
+			die("batch_maildir() -- malloc() failed");
+		}
 
-				default:
-						*q = '\0';
-						if((q = strrchr(p, '\n'))) {
-							*q = '\0';
-						}
-						header_save(p);
+		for (*len = 0; *len < (size_t)st.st_size;) {
+			ssize_t n = read(fd, (buf + *len), (st.st_size - *len));
 
-						q = p;
-						len = 0;
+			if (n <= 0) {
+				break;
 			}
+			*len += n;
 		}
+		close(fd);
+		buf[*len] = '\0';
+
+		return buf;
 	}
-	free(p);
+
+	return (char *)NULL;
 }
 
 /*
- * This is much like strtok, but does not modify the string
- * argument.
- * Args:
- * 	char **s:
- * 		Address of the pointer to the string we are looking at.
- * 	const char *delim:
- * 		The set of delimiters.
- * Return value:
- *	The first token, copied by strndup (caller have to free it),
- * 	if a token is found, or NULL if isn't (os strndup fails)
- * 	*s points to the rest of the string
+ * batch_next() -- Read and parse the next message of the batch
+ *	Recipients come from To/Cc/Bcc as with -t. Returns NULL at the end.
  */
-char *firsttok(char **s, const char *delim) {
-	char *tok;
-	char *rest;
-	rest = strpbrk(*s, delim);
-	if (!rest) {
-		return NULL;
+struct batch_msg *batch_next(struct batch_src *s) {
+	struct batch_msg *b;
+	uint64_t parse_start;
+	char *raw;
+	size_t len;
+	FILE *fp;
+
+	if ((b = (struct batch_msg *)calloc(1, sizeof(struct batch_msg))) == (struct batch_msg *)NULL) {
+		die("batch_next() -- calloc() failed");
 	}
 
-	tok = _strndup(*s,rest-(*s));
-	if (!tok) {
-		die("firsttok() -- strndup() failed");
+	if (s->mbox) {
+		raw = batch_mbox(s, &len);
+		snprintf(b->source, sizeof(b->source), "mbox:%d", (s->n + 1));
+	} else {
+		raw = batch_maildir(s, &len, b->source);
 	}
-	*s = rest + 1;
-	return tok;
+
+	if (raw == (char *)NULL) {
+		free(b);
+		return (struct batch_msg *)NULL;
+	}
+	b->n = ++s->n;
+
+	METRIC_ADD(msg[MSG_ACCEPTED], 1);
+	parse_start = now_us();
+	queue_id_new();
+
+	header_reset();
+	rcpt_reset();
+
+	if ((fp = fmemopen(raw, len, "r")) == (FILE *)NULL) {
+		die("batch_next() -- fmemopen() failed");
+	}
+	header_parse(fp);
+	b->msg = message_read(fp, &b->len, (int64_t *)NULL);
+	body_mem(&b->body, b->msg, b->len);
+	fclose(fp);
+	free(raw);
+
+	METRIC_ADD(msg[MSG_PARSED], 1);
+	METRIC_ADD(bytes_in, b->len);
+	metrics_observe(STAGE_PARSE, (now_us() - parse_start));
+
+	b->route = route_select(cfg);
+
+	strcpy(b->q.qid, queue_id);
+	b->q.created = time(NULL);
+	b->q.next = b->q.created;
+	b->q.lane = message_lane(cfg);
+	b->q.uid = getuid();
+	if (b->route != &cfg->default_route) {
+		b->q.route_kind = b->route->kind;
+		b->q.route = b->route->match;
+	}
+
+	strcpy(b->tr.qid, queue_id);
+	b->tr.size = b->len;
+	b->tr.rcpts = rcpt_count;
+	b->tr.t[STAGE_PARSE] = (now_us() - parse_start);
+
+	b->msgid = message_id;
+	message_id = NULL;
+	rcpt_take(&b->rcpts);
+
+	return b;
 }
 
 /*
- * read_config() -- Open and parse config file and extract values of variables
+ * batch_start() -- Hand a message to the next untried endpoint of its route
+ *	Returns 0 when every endpoint has been tried. The caller takes the
+ *	route token for the first try, see route_token().
  */
-int read_config() {
-	char buf[(BUF_SZ + 1)], *p, *q, *r;
-	FILE *fp;
+int batch_start(CURLM *multi, struct batch_msg *b) {
+	struct endpoint *ep;
 
-	if (config_file == (char *)NULL) {
-		config_file = strdup(CONFIGURATION_FILE);
-		if (config_file == (char *)NULL) {
-			die("read_config() -- strdup() failed");
-		}
+	if ((ep = endpoint_select(b->route, b->tried)) == (struct endpoint *)NULL) {
+		return 0;
 	}
 
-	if ((fp = fopen(config_file, "r")) == NULL) {
-		return 0;
+	if (!b->tried) {
+		b->form = form_new(&b->rcpts.list, &b->body);
 	}
+	b->tried |= (1 << (ep - b->route->ep));
 
-	while (fgets(buf, sizeof(buf), fp)) {
-		char *begin = buf;
-		char *rightside;
+	request_start(&b->rq, b->route, ep, b->form);
+	curl_easy_setopt(b->rq.curl, CURLOPT_PRIVATE, b);
+	curl_multi_add_handle(multi, b->rq.curl);
 
-		/* Make comments invisible */
-		if ((p = strchr(buf, '#'))) {
-			*p = '\0';
-		}
+	return 1;
+}
 
-		/* Ignore malformed lines and comments */
-		if (strchr(buf, '=') == (char *)NULL)
-			continue;
+/*
+ * batch_done() -- Log, spool and report a finished message of the batch
+ *	status is what deliver_status() made of it. Returns BATCH_SENT,
+ *	BATCH_QUEUED or BATCH_FAILED.
+ */
+int batch_done(struct batch_msg *b, int status) {
+	char *result[] = { "sent", "queued", "failed" };
+	int done;
+
+	/* Journal and spool work on the current message */
+	rcpt_put(&b->rcpts);
+	free(message_id);
+	message_id = b->msgid;
+	b->msgid = NULL;
+
+	/* Only messages that went out have a trace */
+	if (b->tried) {
+		deliver_log(&b->tr);
+	}
 
-		/* Parse out keywords */
-		p = firsttok(&begin, "= \t\n");
-		if (p) {
-			rightside=begin;
-			q = firsttok(&begin, "= \t\n");
+	done = (status == 0 ? BATCH_SENT : BATCH_FAILED);
+	if (status == EX_TEMPFAIL) {
+		/* Never tried, it is due right away */
+		b->q.retries = (b->tried ? 1 : 0);
+		b->q.next = (b->q.created + (b->tried ? queue_backoff(b->q.retries) : 0));
+		b->q.msgid = message_id;
+		snprintf(b->q.error, sizeof(b->q.error), "%s", b->tr.error);
+		if (spool_write(&b->q, b->msg, b->len)) {
+			done = BATCH_QUEUED;
 		}
+		b->q.msgid = NULL;
+	}
 
-		if (p && q) {
-			if (strcasecmp(p, "root") == 0) {
-				if ((root = strdup(q)) == (char *)NULL) {
-					die("read_config() -- strdup() failed");
-				}
+	printf("%d\t%s\t%s\t%s\t%s\n", b->n, b->source, b->tr.qid, result[done],
+		((done == BATCH_SENT && b->tr.msgid[0]) ? b->tr.msgid : (b->tr.error[0] ? b->tr.error : "-")));
 
-				if (log_level > 0) {
-					log_event(LOG_INFO, "set root=\"%s\"\n", root);
-				}
-			} else if (strcasecmp(p, "minUserId") == 0) {
-				if((r = strdup(q)) == (char *)NULL) {
-					die("read_config() -- strdup() failed");
-				}
+	if (b->cost) {
+		budget_put(b->cost);
+	}
+	form_release(b->form);
 
-				minuserid = atoi(r);
+	rcpt_reset();
+	free(b->msg);
+	free(b);
 
-				if(log_level > 0) {
-					log_event(LOG_INFO, "set minUserId=\"%d\"\n", minuserid);
-				}
-			} else if (strcasecmp(p, "api") == 0) {
-				if ((api = strdup(q)) == (char *)NULL) {
-					die("read_config() -- strdup() failed");
-				}
+	return done;
+}
 
-				if (log_level > 0) {
-					log_event(LOG_INFO, "set api=\"%s\"\n", api);
-				}
-			} else if (strcasecmp(p, "rewriteDomain") == 0) {
-				if ((p = strrchr(q, '@'))) {
-					domain = strdup(++p);
+/*
+ * smailgun_batch() -- Deliver every message of an mbox or Maildir
+ *	Config, connections and TLS sessions are set up once. Up to
+ *	BATCH_PARALLEL uploads run at the same time on one multi handle, which
+ *	shares the connections between them. One report line per message goes
+ *	to stdout: position, source, queue ID, sent/queued/failed, and the
+ *	Mailgun message ID or the error.
+ */
+int smailgun_batch(char *path) {
+	struct batch_src src;
+	struct batch_msg *b, *w, *waiting = NULL, **tail = &waiting, **pb;
+	struct stat st;
+	CURLMsg *m;
+	CURLM *multi;
+	CURLcode res;
+	CURL *curl;
+	int active = 0, running, left, eof = 0, count[3] = { 0, 0, 0 };
+	uint64_t wait = 0, soonest;
+	long timeout;
+
+	setup();
+
+	/* Every message names its recipients and ends at its end */
+	minus_t = 1;
+	minus_i = 1;
+
+	memset(&src, 0, sizeof(src));
+	if (!*path || strcmp(path, "-") == 0) {
+		src.mbox = stdin;
+	} else if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+		src.maildir = path;
+	} else if ((src.mbox = fopen(path, "r")) == (FILE *)NULL) {
+		die("cannot open %s", path);
+	}
 
-					log_event(LOG_ERR,
-						"set rewriteDomain=\"%s\" is invalid\n", q);
-					log_event(LOG_ERR,
-						"set rewriteDomain=\"%s\" used\n", domain);
-				} else {
-					domain = strdup(q);
-				}
+	net_init();
+	if ((multi = curl_multi_init()) == (CURLM *)NULL) {
+		die("smailgun_batch() -- curl_multi_init() failed");
+	}
 
-				if (domain == (char *)NULL) {
-					die("read_config() -- strdup() failed");
+	while (!eof || active > 0) {
+		/* Stop reading the input while the uploads hold the budget */
+		while (!eof && active < BATCH_PARALLEL && (active == 0 || !budget_full())) {
+			if ((b = batch_next(&src)) == (struct batch_msg *)NULL) {
+				eof = 1;
+			} else if (b->rcpts.list.next == (rcpt_t *)NULL) {
+				log_event(LOG_ERR, "%s: no recipients found", b->tr.qid);
+				snprintf(b->tr.error, sizeof(b->tr.error), "no recipients");
+				METRIC_ADD(msg[MSG_FAILED], 1);
+				count[batch_done(b, EX_UNAVAILABLE)]++;
+			} else if (!budget_take(b->len + BUDGET_MSG_COST)) {
+				/* Spill, the queue runner streams it from disk */
+				snprintf(b->tr.error, sizeof(b->tr.error), "memory budget used up");
+				count[batch_done(b, EX_TEMPFAIL)]++;
+			} else {
+				b->cost = (b->len + BUDGET_MSG_COST);
+				*tail = b;
+				tail = &b->next;
+				active++;
+			}
+		}
+
+		/* Start what the rate of its route allows, in input order per
+		   route, the rest waits without blocking the other uploads */
+		soonest = 0;
+		for (pb = &waiting; (b = *pb); ) {
+			for (w = waiting; w != b && w->route != b->route; w = w->next);
+			if (w != b || (wait = route_token(b->route)) > 0) {
+				if (w == b && (!soonest || wait < soonest)) {
+					soonest = wait;
 				}
+				pb = &b->next;
+				continue;
+			}
 
-				rewrite_domain = 1;
+			if ((*pb = b->next) == (struct batch_msg *)NULL) {
+				tail = pb;
+			}
+			b->next = NULL;
+			if (!batch_start(multi, b)) {
+				count[batch_done(b, deliver_status(&b->tr, CURLE_COULDNT_CONNECT, b->rq.response))]++;
+				active--;
+			}
+		}
 
-				if (log_level > 0) {
-					log_event(LOG_INFO, "set rewriteDomain=\"%s\"\n", domain);
-				}
-			} else if(strcasecmp(p, "fromLineOverride") == 0) {
-				if (strcasecmp(q, "yes") == 0) {
-					override_from = 1;
-				} else {
-					override_from = 0;
-				}
+		curl_multi_perform(multi, &running);
 
-				if (log_level > 0) {
-					log_event(LOG_INFO, "set fromLineOverride=\"%s\"\n",
-						override_from ? "True" : "False");
-				}
-			} else if (strcasecmp(p, "domain") == 0) {
-				if ((domain = strdup(q)) == (char *)NULL) {
-					die("read_config() -- strdup() failed");
-				}
+		while ((m = curl_multi_info_read(multi, &left))) {
+			if (m->msg != CURLMSG_DONE) {
+				continue;
+			}
+			curl = m->easy_handle;
+			res = m->data.result;
 
-				if (log_level > 0) {
-					log_event(LOG_INFO, "set domain=\"%s\"\n", domain);
-				}
-			} else if (strcasecmp(p, "debug") == 0) {
-				if (strcasecmp(q, "yes") == 0) {
-					log_level = 1;
-				} else {
-					log_level = 0;
-				}
-			} else {
-				log_event(LOG_INFO, "unable to set %s=\"%s\"\n", p, q);
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&b);
+			curl_multi_remove_handle(multi, curl);
+
+			res = request_finish(&b->rq, res, &b->tr);
+			if (request_failover(&b->rq, res, &b->tr) && batch_start(multi, b)) {
+				continue;
 			}
-			free(p);
-			free(q);
+
+			count[batch_done(b, deliver_status(&b->tr, res, b->rq.response))]++;
+			active--;
+		}
+
+		/* No later than the next token a waiting message needs */
+		if (active > 0) {
+			timeout = ((soonest && soonest < 1000000) ? (long)((soonest + 999) / 1000) : 1000);
+			curl_multi_poll(multi, NULL, 0, timeout, NULL);
 		}
 	}
-	fclose(fp);
 
-	return 1;
+	fflush(stdout);
+	log_event(LOG_INFO, "batch: %d sent, %d queued, %d failed",
+		count[BATCH_SENT], count[BATCH_QUEUED], count[BATCH_FAILED]);
+
+	curl_multi_cleanup(multi);
+	if (src.mbox && src.mbox != stdin) {
+		fclose(src.mbox);
+	}
+	free(src.line);
+	teardown();
+
+	return (count[BATCH_FAILED] ? EX_UNAVAILABLE : 0);
 }
 
 /*
  * smailgun() -- make the api call to the mailgun service.
+ *	A message deferred by the API, or any message with -odq, is spooled for
+ *	the queue runner.
  */
 int smailgun(char *argv[]) {
-	CURL *curl;
-	CURLcode res;
-	char apifull[41];
+	struct trace tr;
+	struct route *route;
+	struct body body;
+	struct qmsg q;
+	char *msg;
+	uint64_t parse_start;
+	size_t len;
+	int64_t held;
+	int i, status, wake;
+
+	setup();
+
+	METRIC_ADD(msg[MSG_ACCEPTED], 1);
+	parse_start = now_us();
+	queue_id_new();
 
-	if (!read_config()) {
-		log_event(LOG_INFO, "%s not found", config_file);
-	}
+	ht = &headers;
+	rt = &rcpt_list;
 
-	if (!api || !domain) {
-		die("api or domain not set");
+	/* Command line recipients share the set with To/Cc/Bcc */
+	for (i = 1; (argv[i] != NULL); ++i) {
+		rcpt_parse(argv[i]);
 	}
 
-	/* Compose URL */
-	char *url = (char *)malloc(strlen(endpoint) + strlen(domain) + 1);
-	sprintf(url, endpoint, domain);
+	header_parse(stdin);
 
-	/* Create api auth */
-	strcpy(apifull, "api:");
-	strncat(apifull, api, 41);
-	apifull[40] = '\0';
+	held = 0;
+	msg = message_read(stdin, &len, &held);
 
-	printf("domain => %s\n", domain);
-	printf("API => %s\n", apifull);
+	METRIC_ADD(msg[MSG_PARSED], 1);
+	METRIC_ADD(bytes_in, len);
+	metrics_observe(STAGE_PARSE, (now_us() - parse_start));
 
-	ht = &headers;
+	if (rcpt_list.next == (rcpt_t *)NULL) {
+		die("no recipients found");
+	}
 
-	header_parse(stdin);
+	if (body_longline) {
+		log_event(LOG_INFO, "%s: body has lines over %d characters", queue_id, BODY_LINE_MAX);
+	}
 
-	printf("from => %s\n", from);
+	if (minus_v) {
+		for (rt = &rcpt_list; rt->next; rt = rt->next) {
+			printf("rcpt => %s\n", rt->string);
+		}
+		printf("body => %s%s\n", (body_8bit ? "8bit" : "7bit"), (body_longline ? ", long lines" : ""));
+	}
 
-	ht = &headers;
-	while (ht->next) {
-		printf("%s\n", ht->string);
-		ht = ht->next;
+	route = route_select(cfg);
+	if (minus_v) {
+		printf("domain => %s\n", route->domain);
 	}
 
-	int i;
-	for (i = 1; (argv[i] != NULL); ++i) {
-		char *p = strtok(argv[i], ",");
-		while(p) {
-			char *q = addr_parse(p);
-			puts(q);
+	memset(&q, 0, sizeof(q));
+	strcpy(q.qid, queue_id);
+	q.created = time(NULL);
+	q.next = q.created;
+	q.msgid = message_id;
+	q.lane = message_lane(cfg);
+	q.uid = getuid();
+	if (route != &cfg->default_route) {
+		q.route_kind = route->kind;
+		q.route = route->match;
+	}
+
+	if (message_more) {
+		/* Out of budget, the rest of the message goes straight to disk */
+		status = (spool_stream(&q, msg, len, stdin) ? 0 : EX_TEMPFAIL);
+		queue_wake(-1);
+		if (status == 0) {
+			log_event(LOG_INFO, "%s: memory budget used up, queued in %s", queue_id, queue_dir);
+		}
+		if (minus_v) {
+			printf("%s: %s, memory budget used up\n", queue_id, (status == 0 ? "queued" : "cannot queue"));
+		}
+	} else if (queue_only) {
+		status = (spool_write(&q, msg, len) ? 0 : EX_TEMPFAIL);
+		queue_wake(-1);
+	} else if ((wake = queue_wake_open()) >= 0) {
+		/* The daemon has its connections open already, hand it over */
+		status = (spool_write(&q, msg, len) ? 0 : EX_TEMPFAIL);
+		queue_wake(wake);
+		if (minus_v) {
+			printf("%s: handed to the daemon\n", queue_id);
+		}
+	} else {
+		memset(&tr, 0, sizeof(tr));
+		strcpy(tr.qid, queue_id);
+		tr.size = len;
+		tr.rcpts = rcpt_count;
+		tr.t[STAGE_PARSE] = (now_us() - parse_start);
+
+		body_mem(&body, msg, len);
+		status = deliver_record(route, &body, &tr);
+
+		if (status == EX_TEMPFAIL) {
+			q.retries = 1;
+			q.next = (q.created + queue_backoff(q.retries));
+			snprintf(q.error, sizeof(q.error), "%s", tr.error);
+			if (spool_write(&q, msg, len)) {
+				log_event(LOG_INFO, "%s: deferred, queued in %s", queue_id, queue_dir);
+				status = 0;
+			}
+		}
 
-			p = strtok(NULL, ",");
+		if (minus_v) {
+			printf("%s: %s\n", queue_id, (tr.msgid[0] ? tr.msgid : "no message id"));
 		}
 	}
 
-	return 0;
+	if (held) {
+		budget_put(held);
+	}
 
-	/* In windows, this will init the winsock stuff */
-	curl_global_init(CURL_GLOBAL_ALL);
+	free(msg);
+	teardown();
 
-	/* get a curl handle */
-	curl = curl_easy_init();
-	if(curl) {
-		curl_easy_setopt(curl, CURLOPT_URL, url);
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "");
-		curl_easy_setopt(curl, CURLOPT_HTTPAUTH, (long)CURLAUTH_ANY);
-		curl_easy_setopt(curl, CURLOPT_USERPWD, apifull);
+	return status;
+}
 
-		/* Perform the request, res will get the return code */
-		res = curl_easy_perform(curl);
+/*
+ * newaliases() -- Rebuild the compiled alias map
+ */
+int newaliases() {
+	char *file;
+	int n;
 
-		/* Check for errors */
-	 	if(res != CURLE_OK)
-			log_event(LOG_INFO, "api call failed: %s", curl_easy_strerror(res));
+	cfg = config_read();
 
-		/* always cleanup */
-		curl_easy_cleanup(curl);
-	}
+	file = (aliases_file ? aliases_file : ALIASES_FILE);
+	n = alias_build(file);
+
+	fprintf(stdout, "%s: %d aliases\n", file, n);
 
-	curl_global_cleanup();
-	free(url);
 	return 0;
 }
 
-/* pae() - Write error message and exit */
-void pae(char *format, ...) {
-	va_list ap;
+/*
+ * print_stats() -- Print the delivery counters, the mailstats command
+ */
+int print_stats() {
+	cfg = config_read();
 
-	va_start(ap, format);
-	vfprintf(stderr, format, ap);
-	va_end(ap);
+	if (stats_file) {
+		metrics_open(stats_file);
+	}
 
-	exit(0);
+	metrics_write(stdout);
+
+	return 0;
 }
 
 /*
@@ -776,10 +7034,13 @@ char **parse_options(int argc, char *argv[]) {
 
 	if (strcmp(prog, "mailq") == 0) {
 		/* Queue state */
-		pae("mailq: ignore action\n");
+		minus_bp = 1;
 	} else if (strcmp(prog, "newaliases") == 0) {
 		/* Rebuild aliases */
-		pae("newaliases: ignore action\n");
+		minus_bi = 1;
+	} else if (strcmp(prog, "mailstats") == 0) {
+		/* Delivery statistics */
+		mailstats = 1;
 	}
 
 	i = 1;
@@ -788,6 +7049,29 @@ char **parse_options(int argc, char *argv[]) {
 			new_argv[new_argc++] = argv[i++];
 			continue;
 		}
+
+		/* Long options are smailgun extensions */
+		if (argv[i][1] == '-') {
+			if (strncmp(argv[i], "--slowest=", 10) == 0) {
+				if ((slowest = atoi(argv[i] + 10)) <= 0) {
+					pae("%s: --slowest needs a positive count\n", prog);
+				}
+			} else if (strncmp(argv[i], "--since=", 8) == 0) {
+				since = atol(argv[i] + 8);
+			} else if (strncmp(argv[i], "--lookup=", 9) == 0) {
+				lookup = (argv[i] + 9);
+			} else if (strcmp(argv[i], "--batch") == 0) {
+				batch = "-";
+			} else if (strncmp(argv[i], "--batch=", 8) == 0) {
+				batch = (argv[i] + 8);
+			} else if (strncmp(argv[i], "--canon-bench", 13) == 0) {
+				canon_bench_mb = (argv[i][13] == '=' ? atol(argv[i] + 14) : 256);
+			} else {
+				pae("%s: unknown option %s\n", prog, argv[i]);
+			}
+			i++;
+			continue;
+		}
 		j = 0;
 
 		add = 1;
@@ -819,13 +7103,19 @@ char **parse_options(int argc, char *argv[]) {
 						case 'a':	/* ARPANET mode */
 							pae("-ba: action ignored\n");
 						case 'd':	/* Run as a daemon */
-							pae("-bd: action ignored\n");
+							minus_bd = 1;
+							continue;
+						case 'D':	/* Run as a daemon in the foreground */
+							minus_bd = 2;
+							continue;
 						case 'i':	/* Initialise aliases */
-							pae("-bi: action ignored\n", prog);
+							minus_bi = 1;
+							continue;
 						case 'm':	/* Default addr processing */
 							continue;
 						case 'p':	/* Print mailqueue */
-							pae("-bp: action ignored\n", prog);
+							minus_bp = 1;
+							continue;
 						case 's':	/* Read SMTP from stdin */
 							pae("-bs: action ignored\n");
 						case 't':	/* Test mode */
@@ -934,6 +7224,15 @@ char **parse_options(int argc, char *argv[]) {
 
 						/* Alternate aliases file */
 						case 'A':
+							if ((!argv[i][(j + 1)]) && argv[(i + 1)]) {
+								aliases_file = strdup(argv[(i + 1)]);
+								add++;
+							} else {
+								aliases_file = strdup(argv[i] + j + 1);
+							}
+							if (aliases_file == (char *)NULL) {
+								die("parse_options() -- strdup() failed");
+							}
 							goto exit;
 
 						/* Delay connections */
@@ -945,8 +7244,11 @@ char **parse_options(int argc, char *argv[]) {
 							pae("-oD: action ignored\n");
 
 						/* Deliver now, in background or queue */
-						/* This may warrant a diagnostic for b or q */
 						case 'd':
+							queue_only = (argv[i][(j + 1)] == 'q');
+							if (argv[i][(j + 1)]) {
+								j++;
+							}
 							continue;
 
 						/* Errors: mail, write or none */
@@ -972,6 +7274,7 @@ char **parse_options(int argc, char *argv[]) {
 
 						/* DATA ends at EOF, not \n.\n */
 						case 'i':
+							minus_i = 1;
 							continue;
 
 						/* Log level */
@@ -988,6 +7291,15 @@ char **parse_options(int argc, char *argv[]) {
 
 						/* Queue dir */
 						case 'Q':
+							if ((!argv[i][(j + 1)]) && argv[(i + 1)]) {
+								queue_dir = strdup(argv[(i + 1)]);
+								add++;
+							} else {
+								queue_dir = strdup(argv[i] + j + 1);
+							}
+							if (queue_dir == (char *)NULL) {
+								die("parse_options() -- strdup() failed");
+							}
 							goto exit;
 
 						/* Read timeout */
@@ -1000,6 +7312,15 @@ char **parse_options(int argc, char *argv[]) {
 
 						/* Stats file */
 						case 'S':
+							if ((!argv[i][(j + 1)]) && argv[(i + 1)]) {
+								stats_file = strdup(argv[(i + 1)]);
+								add++;
+							} else {
+								stats_file = strdup(argv[i] + j + 1);
+							}
+							if (stats_file == (char *)NULL) {
+								die("parse_options() -- strdup() failed");
+							}
 							goto exit;
 
 						/* Queue timeout */
@@ -1023,7 +7344,42 @@ char **parse_options(int argc, char *argv[]) {
 
 				/* Process the queue [at time] */
 				case 'q':
-					pae("%s: Mail queue is empty\n", prog);
+					/* Sender and recipient filters of the listing */
+					if (argv[i][(j + 1)] == 'S' || argv[i][(j + 1)] == 'R') {
+						char **filter = ((argv[i][(j + 1)] == 'S') ? &qfilter_sender : &qfilter_rcpt);
+
+						if (!argv[i][(j + 2)] && argv[(i + 1)]) {
+							*filter = argv[(i + 1)];
+							add++;
+						} else {
+							*filter = (argv[i] + j + 2);
+						}
+						goto exit;
+					}
+
+					minus_q = 1;
+					if (argv[i][(j + 1)]) {
+						char *unit;
+
+						queue_interval = strtol(argv[i] + j + 1, &unit, 10);
+						switch (*unit) {
+							case 'm':
+								queue_interval *= 60;
+								break;
+							case 'h':
+								queue_interval *= 3600;
+								break;
+							case 'd':
+								queue_interval *= 86400;
+								break;
+						}
+					}
+					goto exit;
+
+				/* A lone dot does not end the message */
+				case 'i':
+					minus_i = 1;
+					continue;
 
 				/* Read message's To/Cc/Bcc lines */
 				case 't':
@@ -1048,6 +7404,10 @@ exit:
 
 	new_argv[new_argc] = NULL;
 
+	if (minus_bi || mailstats || slowest || lookup || minus_bd || minus_q || canon_bench_mb || batch || minus_bp) {
+		return &new_argv[0];
+	}
+
 	if (new_argc <= 1 && !minus_t) {
 		pae("%s: no recipients supplied - mail will not be sent\n", prog);
 	}
@@ -1064,5 +7424,41 @@ int main(int argc, char *argv[]) {
 
 	char **_argv = parse_options(argc, argv);
 
+	if (minus_bi) {
+		return newaliases();
+	}
+
+	if (minus_bp) {
+		return mailq();
+	}
+
+	if (mailstats) {
+		return print_stats();
+	}
+
+	if (slowest) {
+		return trace_slowest(slowest, since);
+	}
+
+	if (lookup) {
+		return journal_lookup(lookup);
+	}
+
+	if (canon_bench_mb > 0) {
+		return canon_bench(canon_bench_mb);
+	}
+
+	if (minus_bd) {
+		return smailgun_daemon();
+	}
+
+	if (minus_q) {
+		return smailgun_queue();
+	}
+
+	if (batch) {
+		return smailgun_batch(batch);
+	}
+
 	return smailgun(_argv);
 }